@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+
+#include "Instance.h"
+#include "Transform.h"
+#include "Vector.h"
+
+// Piecewise linear keyframe track over time in [0, 1]. Before the first and
+// after the last key the value is held.
+template <typename T>
+class Track {
+public:
+    // Keys must be added in increasing time order.
+    void add(float time, const T& value) {
+        keys.push_back({time, value});
+    }
+
+    bool empty() const {
+        return keys.empty();
+    }
+
+    T at(float time) const {
+        if (time <= keys.front().time)
+            return keys.front().value;
+        for (size_t i = 1; i < keys.size(); i++) {
+            if (time < keys[i].time) {
+                float t = (time - keys[i - 1].time) / (keys[i].time - keys[i - 1].time);
+                return keys[i - 1].value * (1 - t) + keys[i].value * t;
+            }
+        }
+        return keys.back().value;
+    }
+
+private:
+    struct Key {
+        float time;
+        T value;
+    };
+    std::vector<Key> keys;
+};
+
+// Keyframed motion of one instance: a translation and a rotation around a
+// fixed axis, applied on top of its rest placement.
+struct InstanceAnimation {
+    Instance* instance;
+    Transform rest;
+    Vec3 axis = Vec3(0, 1, 0);
+    Track<Vec3> translation;
+    Track<float> angle;
+
+    Transform at(float time) const {
+        Transform t = rest;
+        if (!angle.empty()) {
+            // Spin around the instance's own origin, not the world's.
+            Vec3 origin = rest.point(Vec3(0));
+            t = Transform::translate(origin) * Transform::rotate(angle.at(time), axis) *
+                Transform::translate(-origin) * t;
+        }
+        if (!translation.empty())
+            t = Transform::translate(translation.at(time)) * t;
+        return t;
+    }
+};
+
+// What moves over an animation: the camera (position and target tracks;
+// empty tracks keep the scene camera) and any number of instances.
+struct Animation {
+    Track<Vec3> cameraPosition;
+    Track<Vec3> cameraTarget;
+    std::vector<InstanceAnimation> instances;
+};
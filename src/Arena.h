@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator that owns everything created in it and frees it all at
+// once. Memory is taken from the heap in blocks of blockBytes (a larger
+// object gets a block of its own), so thousands of small objects cost a
+// handful of mallocs. Objects with a non-trivial destructor have it run by
+// reset(), newest first. Not thread-safe: give every thread its own arena.
+class Arena {
+   public:
+    explicit Arena(size_t blockBytes = 256 * 1024) : blockBytes(blockBytes) {}
+    ~Arena() { reset(); }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t bytes, size_t alignment) {
+        uintptr_t address = (next + alignment - 1) & ~uintptr_t(alignment - 1);
+        if (current == NULL || address + bytes > end) {
+            size_t size = std::max(blockBytes, bytes + alignment);
+            blocks.emplace_back(new char[size]);
+            current = blocks.back().get();
+            next = uintptr_t(current);
+            end = next + size;
+            reservedBytes += size;
+            address = (next + alignment - 1) & ~uintptr_t(alignment - 1);
+        }
+        next = address + bytes;
+        return reinterpret_cast<void*>(address);
+    }
+
+    template <typename T, typename... Args>
+    T* create(Args&&... args) {
+        T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        objects++;
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            destructors.push_back({object, [](void* p) { static_cast<T*>(p)->~T(); }});
+        return object;
+    }
+
+    // Destroys every object and returns every block to the heap.
+    void reset() {
+        for (auto it = destructors.rbegin(); it != destructors.rend(); ++it)
+            it->destroy(it->object);
+        destructors.clear();
+        blocks.clear();
+        current = NULL;
+        next = end = 0;
+        objects = 0;
+        reservedBytes = 0;
+    }
+
+    size_t objectCount() const { return objects; }
+    size_t blockCount() const { return blocks.size(); }
+    // Bytes taken from the heap, including the unused tail of each block.
+    size_t bytes() const { return reservedBytes; }
+
+   private:
+    struct Destructor {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    size_t blockBytes;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<Destructor> destructors;
+    char* current = NULL;
+    uintptr_t next = 0;
+    uintptr_t end = 0;
+    size_t objects = 0;
+    size_t reservedBytes = 0;
+};
@@ -1,83 +1,1065 @@
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cmath>
+#include <future>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <utility>
 
 #include "BVH.h"
 
-BVH::BVH(std::vector<Object*>& objects) {
-    if (objects.empty())
+BVH::BVH(const std::vector<Object*>& objects, const BVHOptions& options) : options(options), objects(objects) {
+    primitiveBounds.reserve(objects.size());
+    for (Object* object : objects)
+        primitiveBounds.push_back(object->getBounds());
+    build();
+}
+
+BVH::BVH(const IndexedTriangles& triangles, const BVHOptions& options) : options(options), triangles(triangles) {
+    primitiveBounds.reserve(triangles.count);
+    for (uint32_t i = 0; i < triangles.count; i++)
+        primitiveBounds.push_back(triangles.bounds(i));
+    build();
+}
+
+BVH::BVH(const IndexedTriangles& triangles, const BVHOptions& options, Buffer<uint32_t>&& order,
+         Buffer<LinearBVHNode>&& nodes, Buffer<WideBVHNode>&& wide, Buffer<TrianglePacket>&& packets,
+         Buffer<uint32_t>&& leafPackets)
+    : options(options), nodes(std::move(nodes)), wide(std::move(wide)), packets(std::move(packets)),
+      leafPackets(std::move(leafPackets)), triangles(triangles), primitives(std::move(order)) {
+    totalNodes = int(this->nodes.size());
+    measureDepth();
+}
+
+void BVH::build() {
+    if (primitiveBounds.empty())
         return;
-    root = build(objects, 0, objects.size());
+    // Every node only reorders its own range, so once the build is done each
+    // leaf's range of primitives is already in depth-first order.
+    std::vector<uint32_t> order(primitiveBounds.size());
+    std::iota(order.begin(), order.end(), 0);
+    int threads = options.buildThreads > 0 ? options.buildThreads
+                                           : std::max(1u, std::thread::hardware_concurrency());
+    // Fork a few levels deeper than the thread count strictly needs, so uneven
+    // subtrees still keep every thread busy.
+    maxForkDepth = threads > 1 ? int(std::ceil(std::log2(threads))) + 2 : 0;
+    buildThreads = threads;
+    Arena& arena = newNodeArena();
+    if (options.splitMethod == BVHSplitMethod::LBVH)
+        root = buildLBVH(order, arena);
+    else
+        root = build(order, 0, order.size(), 0, arena);
+    primitives = Buffer<uint32_t>(std::move(order));
+    std::vector<Bounds3>().swap(primitiveBounds);
+    if (options.layout == BVHLayout::LINEAR) {
+        nodes.reserve(totalNodes);
+        flatten(root);
+        freeNodes();
+        measureDepth();
+    } else if (options.layout == BVHLayout::WIDE4) {
+        collapse(root);
+        freeNodes();
+        measureDepth();
+    }
 }
 
 BVH::~BVH() {
-    delete root;
+    freeNodes();
+}
+
+Arena& BVH::newNodeArena() {
+    std::lock_guard<std::mutex> lock(nodeArenaMutex);
+    nodeArenas.push_back(std::make_unique<Arena>());
+    return *nodeArenas.back();
+}
+
+void BVH::freeNodes() {
     root = NULL;
+    nodeArenas.clear();
 }
 
-BVH::BVHNode* BVH::build(std::vector<Object*>& objects, std::vector<Object*>::size_type startIdx, std::vector<Object*>::size_type endIdx) {
-    BVHNode* node = new BVHNode();
-    if (endIdx - startIdx == 1) {
-        node->bounds = objects[startIdx]->getBounds();
-        node->object = objects[startIdx];
-        node->left   = NULL;
-        node->right  = NULL;
-        return node;
-    } else if (endIdx - startIdx == 2) {
-        node->left   = build(objects, startIdx, startIdx+1);
-        node->right  = build(objects, startIdx+1, endIdx);
+// Reduces [startIdx, endIdx) in pieces on separate threads once the range is
+// large enough, sharing the build threads with the subtrees forked beside it.
+// Partial results are merged in range order, and the merges used here
+// (bounds, counts) are exact, so the result matches a serial pass.
+template <typename T, typename ChunkFn, typename MergeFn>
+T BVH::reduce(std::vector<uint32_t>::size_type startIdx, std::vector<uint32_t>::size_type endIdx, int depth,
+              ChunkFn chunkFn, MergeFn mergeFn) const {
+    auto nPrims = endIdx - startIdx;
+    int reduceChunks = depth < 31 ? buildThreads >> depth : 0;
+    if (reduceChunks <= 1 || nPrims < (std::vector<uint32_t>::size_type)options.parallelThreshold)
+        return chunkFn(startIdx, endIdx);
+    std::vector<std::future<T>> partials;
+    for (int c = 0; c < reduceChunks; c++) {
+        auto begin = startIdx + nPrims * c / reduceChunks;
+        auto end = startIdx + nPrims * (c + 1) / reduceChunks;
+        partials.push_back(std::async(std::launch::async, chunkFn, begin, end));
+    }
+    T result = partials[0].get();
+    for (int c = 1; c < reduceChunks; c++)
+        result = mergeFn(result, partials[c].get());
+    return result;
+}
+
+BVH::BVHNode* BVH::buildLeaf(std::vector<uint32_t>& order, std::vector<uint32_t>::size_type startIdx,
+                             std::vector<uint32_t>::size_type endIdx, Arena& arena) {
+    BVHNode* node = arena.create<BVHNode>();
+    totalNodes++;
+    node->firstPrim = startIdx;
+    node->nPrims = endIdx - startIdx;
+    for (auto i = startIdx; i < endIdx; ++i)
+        node->bounds = merge(node->bounds, primitiveBounds[order[i]]);
+    return node;
+}
+
+BVH::BVHNode* BVH::build(std::vector<uint32_t>& order, std::vector<uint32_t>::size_type startIdx,
+                         std::vector<uint32_t>::size_type endIdx, int depth, Arena& arena) {
+    if (endIdx - startIdx == 1)
+        return buildLeaf(order, startIdx, endIdx, arena);
+    if (endIdx - startIdx == 2 && options.splitMethod == BVHSplitMethod::MEDIAN) {
+        BVHNode* node = arena.create<BVHNode>();
+        totalNodes++;
+        node->left   = build(order, startIdx, startIdx+1, depth + 1, arena);
+        node->right  = build(order, startIdx+1, endIdx, depth + 1, arena);
         node->bounds = merge(node->left->bounds, node->right->bounds);
         return node;
     } else {
-        Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
-            centroidBounds = merge(centroidBounds, objects[i]->getBounds().centroid);
+        using BoundsPair = std::pair<Bounds3, Bounds3>;
+        BoundsPair rangeBounds = reduce<BoundsPair>(
+            startIdx, endIdx, depth,
+            [this, &order](std::vector<uint32_t>::size_type begin, std::vector<uint32_t>::size_type end) {
+                BoundsPair b;
+                for (auto i = begin; i < end; ++i) {
+                    b.first = merge(b.first, primitiveBounds[order[i]]);
+                    b.second = merge(b.second, primitiveBounds[order[i]].centroid);
+                }
+                return b;
+            },
+            [](const BoundsPair& a, const BoundsPair& b) {
+                return BoundsPair(merge(a.first, b.first), merge(a.second, b.second));
+            });
+        const Bounds3& bounds = rangeBounds.first;
+        const Bounds3& centroidBounds = rangeBounds.second;
         int dim = centroidBounds.longestAxis();
-        switch (dim) {
-            case 0:
-                std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                    return f1->getBounds().centroid.x < f2->getBounds().centroid.x;
-                });
-                break;
-            case 1:
-                std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                    return f1->getBounds().centroid.y < f2->getBounds().centroid.y;
-                });
-                break;
-            case 2:
-                std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                    return f1->getBounds().centroid.z < f2->getBounds().centroid.z;
-                });
-                break;
-        }
-        std::vector<Object*>::size_type midIdx = (endIdx - startIdx) / 2 + startIdx;
-        node->left  = build(objects, startIdx, midIdx);
-        node->right = build(objects, midIdx, endIdx);
+        std::vector<uint32_t>::size_type midIdx = (endIdx - startIdx) / 2 + startIdx;
+        if (options.splitMethod == BVHSplitMethod::SAH) {
+            midIdx = splitSAH(order, startIdx, endIdx, depth, bounds, centroidBounds, dim);
+            if (midIdx == endIdx)
+                return buildLeaf(order, startIdx, endIdx, arena);
+        } else {
+            // Only the node's own range needs to be split around its median.
+            std::nth_element(order.begin() + startIdx, order.begin() + midIdx, order.begin() + endIdx,
+                             [this, dim](uint32_t p1, uint32_t p2) {
+                                 return primitiveBounds[p1].centroid[dim] < primitiveBounds[p2].centroid[dim];
+                             });
+        }
+        BVHNode* node = arena.create<BVHNode>();
+        totalNodes++;
+        node->axis = dim;
+        // The two halves touch disjoint ranges, so large ones are built
+        // concurrently, the forked half into an arena of its own.
+        if (depth < maxForkDepth && endIdx - startIdx >= (std::vector<uint32_t>::size_type)options.parallelThreshold) {
+            Arena& forkArena = newNodeArena();
+            std::future<BVHNode*> left = std::async(std::launch::async, [&, startIdx, midIdx, depth]() {
+                return build(order, startIdx, midIdx, depth + 1, forkArena);
+            });
+            node->right = build(order, midIdx, endIdx, depth + 1, arena);
+            node->left  = left.get();
+        } else {
+            node->left  = build(order, startIdx, midIdx, depth + 1, arena);
+            node->right = build(order, midIdx, endIdx, depth + 1, arena);
+        }
         node->bounds = merge(node->left->bounds, node->right->bounds);
+        return node;
+    }
+}
+
+std::vector<uint32_t>::size_type BVH::splitSAH(std::vector<uint32_t>& order, std::vector<uint32_t>::size_type startIdx,
+                                               std::vector<uint32_t>::size_type endIdx, int depth,
+                                               const Bounds3& bounds, const Bounds3& centroidBounds, int dim) const {
+    auto nPrims = endIdx - startIdx;
+    auto midIdx = nPrims / 2 + startIdx;
+    // All centroids coincide, no plane separates them: split by index unless
+    // they fit into one leaf.
+    if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+        if (nPrims <= leafSize())
+            return endIdx;
+        return midIdx;
+    }
+
+    struct Bucket {
+        int count = 0;
+        Bounds3 bounds;
+    };
+    // Fixed-size arrays keep the per-node split search off the heap.
+    using Buckets = std::array<Bucket, maxBuckets>;
+    int nBuckets = std::clamp(options.bucketCount, 2, maxBuckets);
+    auto bucketOf = [&](uint32_t primitive) {
+        int b = nBuckets * centroidBounds.offset(primitiveBounds[primitive].centroid)[dim];
+        return std::min(b, nBuckets - 1);
+    };
+    Buckets buckets = reduce<Buckets>(
+        startIdx, endIdx, depth,
+        [&](std::vector<uint32_t>::size_type begin, std::vector<uint32_t>::size_type end) {
+            Buckets partial;
+            for (auto i = begin; i < end; ++i) {
+                Bucket& bucket = partial[bucketOf(order[i])];
+                bucket.count++;
+                bucket.bounds = merge(bucket.bounds, primitiveBounds[order[i]]);
+            }
+            return partial;
+        },
+        [nBuckets](Buckets a, const Buckets& b) {
+            for (int i = 0; i < nBuckets; i++) {
+                a[i].count += b[i].count;
+                a[i].bounds = merge(a[i].bounds, b[i].bounds);
+            }
+            return a;
+        });
+
+    // Sweep from the right to get the cost of everything above each plane,
+    // then from the left to combine it with everything below.
+    std::array<float, maxBuckets - 1> costAbove;
+    Bounds3 above;
+    int countAbove = 0;
+    for (int i = nBuckets - 1; i > 0; --i) {
+        above = merge(above, buckets[i].bounds);
+        countAbove += buckets[i].count;
+        costAbove[i - 1] = countAbove * above.surfaceArea();
+    }
+    Bounds3 below;
+    int countBelow = 0;
+    int minBucket = 0;
+    float minCost = std::numeric_limits<float>::max();
+    for (int i = 0; i < nBuckets - 1; ++i) {
+        below = merge(below, buckets[i].bounds);
+        countBelow += buckets[i].count;
+        float cost = countBelow * below.surfaceArea() + costAbove[i];
+        if (cost < minCost) {
+            minCost = cost;
+            minBucket = i;
+        }
+    }
+    float area = bounds.surfaceArea();
+    minCost = options.traversalCost + options.intersectionCost * (area > 0 ? minCost / area : nPrims);
+    float leafCost = options.intersectionCost * nPrims;
+    if (nPrims <= leafSize() && leafCost <= minCost)
+        return endIdx;
+
+    auto mid = std::partition(order.begin() + startIdx, order.begin() + endIdx,
+                              [&](uint32_t primitive) { return bucketOf(primitive) <= minBucket; });
+    midIdx = mid - order.begin();
+    if (midIdx == startIdx || midIdx == endIdx)
+        midIdx = nPrims / 2 + startIdx;
+    return midIdx;
+}
+
+// Spreads the low 10 bits of x out to every third bit.
+static inline uint32_t leftShift3(uint32_t x) {
+    if (x == (1 << 10))
+        --x;
+    x = (x | (x << 16)) & 0b00000011000000000000000011111111;
+    x = (x | (x << 8))  & 0b00000011000000001111000000001111;
+    x = (x | (x << 4))  & 0b00000011000011000011000011000011;
+    x = (x | (x << 2))  & 0b00001001001001001001001001001001;
+    return x;
+}
+
+// 30-bit Morton code of a point in [0, 1]^3; bit 3 * i + axis belongs to axis.
+static inline uint32_t encodeMorton3(const Vec3& v) {
+    auto quantize = [](float f) { return uint32_t(clamp(0, 1024, f * 1024)); };
+    return (leftShift3(quantize(v.z)) << 2) | (leftShift3(quantize(v.y)) << 1) | leftShift3(quantize(v.x));
+}
+
+BVH::BVHNode* BVH::buildLBVH(std::vector<uint32_t>& order, Arena& arena) {
+    Bounds3 centroidBounds;
+    for (uint32_t primitive : order)
+        centroidBounds = merge(centroidBounds, primitiveBounds[primitive].centroid);
+
+    // Sort (code, index) pairs with a least significant digit radix sort.
+    struct MortonPrimitive {
+        uint32_t code;
+        uint32_t index;
+    };
+    std::vector<MortonPrimitive> sorted(order.size()), scratch(order.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+        sorted[i] = {encodeMorton3(centroidBounds.offset(primitiveBounds[order[i]].centroid)), i};
+    const int bitsPerPass = 6;
+    const int nBuckets = 1 << bitsPerPass;
+    const uint32_t bitMask = nBuckets - 1;
+    for (int lowBit = 0; lowBit < 30; lowBit += bitsPerPass) {
+        int offsets[nBuckets] = {};
+        for (const MortonPrimitive& mp : sorted)
+            offsets[(mp.code >> lowBit) & bitMask]++;
+        for (int b = 0, sum = 0; b < nBuckets; b++) {
+            int count = offsets[b];
+            offsets[b] = sum;
+            sum += count;
+        }
+        for (const MortonPrimitive& mp : sorted)
+            scratch[offsets[(mp.code >> lowBit) & bitMask]++] = mp;
+        std::swap(sorted, scratch);
+    }
+
+    std::vector<uint32_t> unsorted = order;
+    std::vector<uint32_t> codes(order.size());
+    for (size_t i = 0; i < sorted.size(); i++) {
+        order[i] = unsorted[sorted[i].index];
+        codes[i] = sorted[i].code;
+    }
+    return emitLBVH(order, codes, 0, order.size(), 29, arena);
+}
+
+// Splits the sorted range where its Morton codes first differ, highest bit first.
+BVH::BVHNode* BVH::emitLBVH(std::vector<uint32_t>& order, const std::vector<uint32_t>& mortonCodes,
+                            std::vector<uint32_t>::size_type startIdx, std::vector<uint32_t>::size_type endIdx, int bitIndex,
+                            Arena& arena) {
+    auto nPrims = endIdx - startIdx;
+    if (nPrims <= leafSize())
+        return buildLeaf(order, startIdx, endIdx, arena);
+    std::vector<uint32_t>::size_type midIdx;
+    // Skip bits that every code in the range shares.
+    while (true) {
+        if (bitIndex < 0) {
+            // Identical codes but too many for one leaf: split by index.
+            midIdx = startIdx + nPrims / 2;
+            break;
+        }
+        uint32_t mask = 1u << bitIndex;
+        if ((mortonCodes[startIdx] & mask) != (mortonCodes[endIdx - 1] & mask)) {
+            // The range is sorted, so the bit flips exactly once inside it.
+            midIdx = std::partition_point(mortonCodes.begin() + startIdx, mortonCodes.begin() + endIdx,
+                                          [mask](uint32_t code) { return (code & mask) == 0; }) -
+                     mortonCodes.begin();
+            break;
+        }
+        bitIndex--;
     }
+    BVHNode* node = arena.create<BVHNode>();
+    totalNodes++;
+    node->axis = bitIndex >= 0 ? bitIndex % 3 : 0;
+    node->left = emitLBVH(order, mortonCodes, startIdx, midIdx, bitIndex - 1, arena);
+    node->right = emitLBVH(order, mortonCodes, midIdx, endIdx, bitIndex - 1, arena);
+    node->bounds = merge(node->left->bounds, node->right->bounds);
     return node;
 }
 
+uint32_t BVH::flatten(BVHNode* node) {
+    uint32_t offset = nodes.size();
+    nodes.emplace_back();
+    LinearBVHNode linear;
+    for (int i = 0; i < 3; i++) {
+        linear.pMin[i] = node->bounds.pMin[i];
+        linear.pMax[i] = node->bounds.pMax[i];
+    }
+    linear.axis = node->axis;
+    linear.pad = 0;
+    if (node->nPrims > 0) {
+        linear.primitivesOffset = node->firstPrim;
+        linear.nPrimitives = node->nPrims;
+    } else {
+        linear.nPrimitives = 0;
+        flatten(node->left);
+        linear.secondChildOffset = flatten(node->right);
+    }
+    nodes[offset] = linear;
+    return offset;
+}
+
+// Children are stored after their parents in both layouts, so one forward
+// sweep gives every node its level.
+void BVH::measureDepth() {
+    std::vector<uint32_t> level(nodes.size(), 1);
+    linearDepth = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        linearDepth = std::max(linearDepth, level[i]);
+        if (nodes[i].nPrimitives == 0)
+            level[i + 1] = level[nodes[i].secondChildOffset] = level[i] + 1;
+    }
+    level.assign(wide.size(), 1);
+    wideDepth = 0;
+    for (size_t i = 0; i < wide.size(); i++) {
+        wideDepth = std::max(wideDepth, level[i]);
+        for (int lane = 0; lane < wide[i].nChildren; lane++) {
+            if (wide[i].nPrimitives[lane] == 0)
+                level[wide[i].child[lane]] = level[i] + 1;
+        }
+    }
+}
+
+// Pulls the children of the largest interior nodes up into one wide node
+// until it has four children or only leaves are left.
+uint32_t BVH::collapse(BVHNode* node) {
+    BVHNode* children[4] = {node};
+    int nChildren = 1;
+    while (nChildren < 4) {
+        int largest = -1;
+        for (int i = 0; i < nChildren; i++) {
+            if (children[i]->nPrims == 0 &&
+                (largest < 0 || children[i]->bounds.surfaceArea() > children[largest]->bounds.surfaceArea()))
+                largest = i;
+        }
+        if (largest < 0)
+            break;
+        BVHNode* expanded = children[largest];
+        children[largest] = expanded->left;
+        children[nChildren++] = expanded->right;
+    }
+    uint32_t offset = wide.size();
+    wide.emplace_back();
+    WideBVHNode node4 = {};
+    node4.nChildren = nChildren;
+    for (int i = 0; i < nChildren; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            node4.pMin[axis][i] = children[i]->bounds.pMin[axis];
+            node4.pMax[axis][i] = children[i]->bounds.pMax[axis];
+        }
+        if (children[i]->nPrims > 0) {
+            node4.child[i] = children[i]->firstPrim;
+            node4.nPrimitives[i] = children[i]->nPrims;
+        } else {
+            node4.child[i] = collapse(children[i]);
+        }
+    }
+    wide[offset] = node4;
+    return offset;
+}
+
+void BVH::leaves(std::vector<std::pair<uint32_t, uint32_t>>& out) const {
+    if (!nodes.empty()) {
+        for (const LinearBVHNode& node : nodes) {
+            if (node.nPrimitives > 0)
+                out.emplace_back(node.primitivesOffset, node.nPrimitives);
+        }
+    } else if (!wide.empty()) {
+        for (const WideBVHNode& node : wide) {
+            for (int i = 0; i < node.nChildren; i++) {
+                if (node.nPrimitives[i] > 0)
+                    out.emplace_back(node.child[i], node.nPrimitives[i]);
+            }
+        }
+    } else if (root != NULL) {
+        std::vector<BVHNode*> todo = {root};
+        while (!todo.empty()) {
+            BVHNode* node = todo.back();
+            todo.pop_back();
+            if (node->nPrims > 0) {
+                out.emplace_back(node->firstPrim, node->nPrims);
+            } else {
+                todo.push_back(node->left);
+                todo.push_back(node->right);
+            }
+        }
+    }
+}
+
+void BVH::packTriangles(const std::function<void(const Object*, Vec3& v0, Vec3& e1, Vec3& e2)>& triangle) {
+    packLeaves([&](uint32_t i, Vec3& v0, Vec3& e1, Vec3& e2) { triangle(objects[primitives[i]], v0, e1, e2); });
+}
+
+void BVH::packTriangles() {
+    assert(triangles.owner != NULL);
+    packLeaves([&](uint32_t i, Vec3& v0, Vec3& e1, Vec3& e2) {
+        Vec3 v1, v2;
+        triangles.corners(primitives[i], v0, v1, v2);
+        e1 = v1 - v0;
+        e2 = v2 - v0;
+    });
+}
+
+void BVH::packLeaves(const std::function<void(uint32_t, Vec3& v0, Vec3& e1, Vec3& e2)>& triangle) {
+    std::vector<std::pair<uint32_t, uint32_t>> leafRanges;
+    leaves(leafRanges);
+    packets.clear();
+    leafPackets.assign(primitives.size(), 0);
+    for (const std::pair<uint32_t, uint32_t>& leaf : leafRanges) {
+        leafPackets[leaf.first] = packets.size();
+        for (uint32_t start = 0; start < leaf.second; start += 4) {
+            TrianglePacket packet = {};
+            for (uint32_t lane = 0; lane < 4 && start + lane < leaf.second; lane++) {
+                uint32_t prim = leaf.first + start + lane;
+                Vec3 v0, e1, e2;
+                triangle(prim, v0, e1, e2);
+                for (int axis = 0; axis < 3; axis++) {
+                    packet.v0[axis][lane] = v0[axis];
+                    packet.e1[axis][lane] = e1[axis];
+                    packet.e2[axis][lane] = e2[axis];
+                }
+                packet.primitive[lane] = prim;
+            }
+            packets.push_back(packet);
+        }
+    }
+}
+
+void BVH::record(Hit& hit, uint32_t i, float t, float u, float v) const {
+    if (triangles.owner != NULL)
+        hit.record(t, u, v, triangles.owner, primitives[i]);
+    else
+        hit.record(t, u, v, objects[primitives[i]]);
+}
+
+bool BVH::intersectLeaf(uint32_t first, uint32_t count, const Ray& ray, Hit& hit) const {
+    threadTraversalStats.primitiveTests += count;
+    bool found = false;
+    if (packets.empty() && triangles.owner != NULL) {
+        for (uint32_t i = first; i < first + count; i++)
+            found |= triangles.intersect(primitives[i], ray, hit);
+        return found;
+    }
+    if (packets.empty()) {
+        for (uint32_t i = first; i < first + count; i++)
+            found |= objects[primitives[i]]->intersect(ray, hit);
+        return found;
+    }
+    PacketRay packetRay(ray);
+    for (uint32_t p = leafPackets[first], end = p + (count + 3) / 4; p < end; p++) {
+        const TrianglePacket& packet = packets[p];
+        Vec4 t4, u4, v4;
+        int hitMask = rayTriangleIntersect(packet, packetRay, hit.t, t4, u4, v4);
+        if (hitMask == 0)
+            continue;
+        alignas(16) float t[4], u[4], v[4];
+        t4.store(t);
+        u4.store(u);
+        v4.store(v);
+        int lane = -1;
+        for (int i = 0; i < 4; i++) {
+            if ((hitMask & (1 << i)) && (lane < 0 || t[i] < t[lane]))
+                lane = i;
+        }
+        record(hit, packet.primitive[lane], t[lane], u[lane], v[lane]);
+        found = true;
+    }
+    return found;
+}
+
+int BVH::intersectLeaf(uint32_t first, uint32_t count, const RayPacket& packet, int active, Hit hits[]) const {
+    threadTraversalStats.primitiveTests += count * rayCount(active);
+    int found = 0;
+    if (packets.empty() && triangles.owner != NULL) {
+        for (int lane = 0; lane < RayPacket::size; lane++) {
+            if (!(active & (1 << lane)))
+                continue;
+            Ray ray = packet.ray(lane);
+            for (uint32_t i = first; i < first + count; i++) {
+                if (triangles.intersect(primitives[i], ray, hits[lane]))
+                    found |= 1 << lane;
+            }
+        }
+        return found;
+    }
+    if (packets.empty()) {
+        for (uint32_t i = first; i < first + count; i++)
+            found |= objects[primitives[i]]->intersect(packet, active, hits);
+        return found;
+    }
+    for (uint32_t p = leafPackets[first], end = p + (count + 3) / 4; p < end; p++) {
+        const TrianglePacket& leafTriangles = packets[p];
+        int lanes = std::min(4u, first + count - leafTriangles.primitive[0]);
+        // Lane by lane, so equally distant triangles are resolved as in the
+        // single-ray test.
+        for (int lane = 0; lane < lanes; lane++) {
+            for (int group = 0; group < RayPacket::size; group += 4) {
+                int groupActive = (active >> group) & 0xF;
+                if (groupActive == 0)
+                    continue;
+                alignas(16) float tMax[4];
+                for (int i = 0; i < 4; i++)
+                    tMax[i] = hits[group + i].t;
+                Vec4 t4, u4, v4;
+                int hitMask =
+                    rayTriangleIntersect(leafTriangles, lane, packet, group, Vec4::load(tMax), t4, u4, v4) & groupActive;
+                if (hitMask == 0)
+                    continue;
+                alignas(16) float t[4], u[4], v[4];
+                t4.store(t);
+                u4.store(u);
+                v4.store(v);
+                for (int i = 0; i < 4; i++) {
+                    if (hitMask & (1 << i)) {
+                        record(hits[group + i], leafTriangles.primitive[lane], t[i], u[i], v[i]);
+                        found |= 1 << (group + i);
+                    }
+                }
+            }
+        }
+    }
+    return found;
+}
+
+bool BVH::occludedLeaf(uint32_t first, uint32_t count, const Ray& ray, float tMax) const {
+    if (packets.empty()) {
+        for (uint32_t i = first; i < first + count; i++) {
+            threadTraversalStats.primitiveTests++;
+            uint32_t primitive = primitives[i];
+            if (triangles.owner != NULL ? triangles.occluded(primitive, ray, tMax)
+                                        : objects[primitive]->occluded(ray, tMax))
+                return true;
+        }
+        return false;
+    }
+    PacketRay packetRay(ray);
+    for (uint32_t p = leafPackets[first], end = p + (count + 3) / 4; p < end; p++) {
+        threadTraversalStats.primitiveTests += std::min(4u, first + count - packets[p].primitive[0]);
+        Vec4 t, u, v;
+        if (rayTriangleIntersect(packets[p], packetRay, tMax, t, u, v))
+            return true;
+    }
+    return false;
+}
+
 Intersection BVH::rayCast(const Ray& ray) const {
-    Intersection res;
+    Hit hit;
+    return intersect(ray, hit) ? surfaceIntersection(ray, hit) : Intersection();
+}
+
+bool BVH::intersect(const Ray& ray, Hit& hit) const {
+    if (options.layout == BVHLayout::LINEAR)
+        return !nodes.empty() && intersectLinear(ray, hit);
+    if (options.layout == BVHLayout::WIDE4)
+        return !wide.empty() && intersectWide(ray, hit);
     if (root == NULL)
-        return res;
-    res = rayCast(root, ray);
-    return res;
-}
-
-Intersection BVH::rayCast(BVHNode* node, const Ray& ray) const {
-    Intersection res;
-    if (node == NULL)
-        return res;
-    if (!node->bounds.rayCast(ray))
-        return res;
-    if (node->left == NULL && node->right == NULL)
-        return node->object->rayCast(ray);
-    res = rayCast(node->left, ray);
-    if (!res.happened)
-        return rayCast(node->right, ray);
-    Intersection right = rayCast(node->right, ray);
-    if (right.happened && right.distance < res.distance)
-        return right;
-    return res;
+        return false;
+    bool dirIsNeg[3] = {ray.direction_inv.x < 0, ray.direction_inv.y < 0, ray.direction_inv.z < 0};
+    return intersect(root, ray, dirIsNeg, hit);
+}
+
+bool BVH::intersect(BVHNode* node, const Ray& ray, const bool dirIsNeg[3], Hit& hit) const {
+    float tEnter;
+    float tMax = options.closestHitCulling ? hit.t : std::numeric_limits<float>::max();
+    threadTraversalStats.nodeVisits++;
+    if (!node->bounds.rayCast(ray, tMax, tEnter))
+        return false;
+    if (node->nPrims > 0)
+        return intersectLeaf(node->firstPrim, node->nPrims, ray, hit);
+    // Along a negative direction the right (upper) child is the nearer one.
+    bool first, second;
+    if (options.closestHitCulling && dirIsNeg[node->axis]) {
+        first = intersect(node->right, ray, dirIsNeg, hit);
+        second = intersect(node->left, ray, dirIsNeg, hit);
+    } else {
+        first = intersect(node->left, ray, dirIsNeg, hit);
+        second = intersect(node->right, ray, dirIsNeg, hit);
+    }
+    return first || second;
+}
+
+bool BVH::occluded(const Ray& ray, float tMax) const {
+    if (options.layout == BVHLayout::LINEAR)
+        return !nodes.empty() && occludedLinear(ray, tMax);
+    if (options.layout == BVHLayout::WIDE4)
+        return !wide.empty() && occludedWide(ray, tMax);
+    return root != NULL && occluded(root, ray, tMax);
+}
+
+bool BVH::occluded(BVHNode* node, const Ray& ray, float tMax) const {
+    float tEnter;
+    threadTraversalStats.nodeVisits++;
+    if (!node->bounds.rayCast(ray, tMax, tEnter))
+        return false;
+    if (node->nPrims > 0) {
+        return occludedLeaf(node->firstPrim, node->nPrims, ray, tMax);
+    }
+    return occluded(node->left, ray, tMax) || occluded(node->right, ray, tMax);
+}
+
+static Bounds3 nodeBounds(const BVH::LinearBVHNode& node) {
+    return Bounds3(Vec3(node.pMin[0], node.pMin[1], node.pMin[2]),
+                   Vec3(node.pMax[0], node.pMax[1], node.pMax[2]));
+}
+
+static Bounds3 childBounds(const BVH::WideBVHNode& node, int i) {
+    return Bounds3(Vec3(node.pMin[0][i], node.pMin[1][i], node.pMin[2][i]),
+                   Vec3(node.pMax[0][i], node.pMax[1][i], node.pMax[2][i]));
+}
+
+Bounds3 BVH::leafBounds(uint32_t first, uint32_t count) const {
+    Bounds3 bounds;
+    for (uint32_t i = first; i < first + count; i++) {
+        uint32_t primitive = primitives[i];
+        bounds = merge(bounds, triangles.owner != NULL ? triangles.bounds(primitive) : objects[primitive]->getBounds());
+    }
+    return bounds;
+}
+
+void BVH::refit() {
+    if (root != NULL)
+        refit(root);
+    // Children are stored after their parents in both flattened layouts, so a
+    // reverse sweep sees every child before the node that contains it.
+    for (size_t i = nodes.size(); i-- > 0;) {
+        LinearBVHNode& node = nodes[i];
+        Bounds3 bounds = node.nPrimitives > 0
+            ? leafBounds(node.primitivesOffset, node.nPrimitives)
+            : merge(nodeBounds(nodes[i + 1]), nodeBounds(nodes[node.secondChildOffset]));
+        for (int axis = 0; axis < 3; axis++) {
+            node.pMin[axis] = bounds.pMin[axis];
+            node.pMax[axis] = bounds.pMax[axis];
+        }
+    }
+    for (size_t i = wide.size(); i-- > 0;) {
+        WideBVHNode& node = wide[i];
+        for (int lane = 0; lane < node.nChildren; lane++) {
+            Bounds3 bounds;
+            if (node.nPrimitives[lane] > 0) {
+                bounds = leafBounds(node.child[lane], node.nPrimitives[lane]);
+            } else {
+                const WideBVHNode& child = wide[node.child[lane]];
+                for (int j = 0; j < child.nChildren; j++)
+                    bounds = merge(bounds, childBounds(child, j));
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                node.pMin[axis][lane] = bounds.pMin[axis];
+                node.pMax[axis][lane] = bounds.pMax[axis];
+            }
+        }
+    }
+}
+
+Bounds3 BVH::refit(BVHNode* node) {
+    if (node->nPrims > 0)
+        node->bounds = leafBounds(node->firstPrim, node->nPrims);
+    else
+        node->bounds = merge(refit(node->left), refit(node->right));
+    return node->bounds;
+}
+
+float BVH::sahCost() const {
+    if (root != NULL)
+        return sahCost(root);
+    if (!nodes.empty())
+        return sahCost(uint32_t(0));
+    if (!wide.empty())
+        return sahCostWide(0);
+    return 0;
+}
+
+float BVH::sahCost(BVHNode* node) const {
+    if (node->nPrims > 0)
+        return options.intersectionCost * node->nPrims;
+    float area = node->bounds.surfaceArea();
+    if (area <= 0)
+        return options.traversalCost + sahCost(node->left) + sahCost(node->right);
+    return options.traversalCost + (node->left->bounds.surfaceArea() * sahCost(node->left) +
+                                    node->right->bounds.surfaceArea() * sahCost(node->right)) / area;
+}
+
+static float surfaceArea(const BVH::LinearBVHNode& node) {
+    return nodeBounds(node).surfaceArea();
+}
+
+float BVH::sahCost(uint32_t nodeIdx) const {
+    const LinearBVHNode& node = nodes[nodeIdx];
+    if (node.nPrimitives > 0)
+        return options.intersectionCost * node.nPrimitives;
+    uint32_t left = nodeIdx + 1;
+    uint32_t right = node.secondChildOffset;
+    float area = surfaceArea(node);
+    if (area <= 0)
+        return options.traversalCost + sahCost(left) + sahCost(right);
+    return options.traversalCost + (surfaceArea(nodes[left]) * sahCost(left) +
+                                    surfaceArea(nodes[right]) * sahCost(right)) / area;
+}
+
+
+float BVH::sahCostWide(uint32_t nodeIdx) const {
+    const WideBVHNode& node = wide[nodeIdx];
+    Bounds3 bounds;
+    for (int i = 0; i < node.nChildren; i++)
+        bounds = merge(bounds, childBounds(node, i));
+    float area = bounds.surfaceArea();
+    float cost = 0;
+    for (int i = 0; i < node.nChildren; i++) {
+        float childCost = node.nPrimitives[i] > 0 ? options.intersectionCost * node.nPrimitives[i]
+                                                  : sahCostWide(node.child[i]);
+        cost += area > 0 ? childBounds(node, i).surfaceArea() / area * childCost : childCost;
+    }
+    return options.traversalCost + cost;
+}
+
+namespace {
+// Traversal stack of a flattened tree. It lives on the call stack for the
+// usual trees and moves to the heap only for ones deeper than N levels.
+template <typename T, int N>
+class TraversalStack {
+   public:
+    explicit TraversalStack(size_t capacity) : items(local) {
+        if (capacity > N) {
+            heap.resize(capacity);
+            items = heap.data();
+        }
+    }
+
+    T& operator[](int i) { return items[i]; }
+
+   private:
+    T local[N];
+    std::vector<T> heap;
+    T* items;
+};
+}
+
+// Same slab test as Bounds3::rayCast on a flattened node.
+static inline bool rayCastBox(const BVH::LinearBVHNode& node, const Ray& ray, float tMax, float& tEnter) {
+    // pMin and pMax are each followed by at least one more float in the node.
+    return rayCastSlabs(Vec3::load(node.pMin), Vec3::load(node.pMax), ray, tMax, tEnter);
+}
+
+bool BVH::intersectLinear(const Ray& ray, Hit& hit, uint32_t root) const {
+    bool found = false;
+    float tMax = options.closestHitCulling ? hit.t : std::numeric_limits<float>::max();
+    bool dirIsNeg[3] = {ray.direction_inv.x < 0, ray.direction_inv.y < 0, ray.direction_inv.z < 0};
+    TraversalStats& stats = threadTraversalStats;
+    // A descent pushes at most one node per level below the root.
+    TraversalStack<uint32_t, 64> stack(linearDepth);
+    int stackSize = 0;
+    uint32_t current = root;
+    while (true) {
+        const LinearBVHNode& node = nodes[current];
+        float tEnter;
+        stats.nodeVisits++;
+        if (rayCastBox(node, ray, tMax, tEnter)) {
+            if (node.nPrimitives > 0) {
+                if (intersectLeaf(node.primitivesOffset, node.nPrimitives, ray, hit)) {
+                    found = true;
+                    if (options.closestHitCulling)
+                        tMax = hit.t;
+                }
+            } else {
+                assert(stackSize < int(linearDepth));
+                // Descend into the nearer child first; the other one is culled
+                // when it is popped if it starts beyond the closest hit by then.
+                if (options.closestHitCulling && dirIsNeg[node.axis]) {
+                    stack[stackSize++] = current + 1;
+                    current = node.secondChildOffset;
+                } else {
+                    stack[stackSize++] = node.secondChildOffset;
+                    current++;
+                }
+                continue;
+            }
+        }
+        if (stackSize == 0)
+            break;
+        current = stack[--stackSize];
+    }
+    return found;
+}
+
+int BVH::intersect(const RayPacket& packet, int active, Hit hits[]) const {
+    // Rays heading into different octants part ways near the root and would
+    // share little of the traversal.
+    if (options.layout == BVHLayout::LINEAR && packet.sameOctant(active))
+        return nodes.empty() ? 0 : intersectLinear(packet, active, hits);
+    int found = 0;
+    for (int i = 0; i < RayPacket::size; i++) {
+        if ((active & (1 << i)) && intersect(packet.ray(i), hits[i]))
+            found |= 1 << i;
+    }
+    return found;
+}
+
+namespace {
+// Pending node of the packet traversal with the rays that still need it.
+struct PacketStackEntry {
+    uint32_t node;
+    int active;
+};
+}
+
+int BVH::intersectLinear(const RayPacket& packet, int active, Hit hits[]) const {
+    int found = 0;
+    alignas(16) float tMax[RayPacket::size];
+    for (int i = 0; i < RayPacket::size; i++)
+        tMax[i] = options.closestHitCulling ? hits[i].t : std::numeric_limits<float>::max();
+    // All rays point into the same octant, so they agree on which child is nearer.
+    int lead = 0;
+    while (!(active & (1 << lead)))
+        lead++;
+    bool dirIsNeg[3] = {packet.directionInv[0][lead] < 0, packet.directionInv[1][lead] < 0,
+                        packet.directionInv[2][lead] < 0};
+    TraversalStats& stats = threadTraversalStats;
+    TraversalStack<PacketStackEntry, 64> stack(linearDepth);
+    int stackSize = 0;
+    uint32_t current = 0;
+    while (true) {
+        const LinearBVHNode& node = nodes[current];
+        stats.nodeVisits++;
+        active = packet.rayCastBox(node.pMin, node.pMax, tMax, active);
+        if (active != 0 && rayCount(active) <= options.packetFallbackRays) {
+            for (int i = 0; i < RayPacket::size; i++) {
+                if ((active & (1 << i)) && intersectLinear(packet.ray(i), hits[i], current)) {
+                    found |= 1 << i;
+                    if (options.closestHitCulling)
+                        tMax[i] = hits[i].t;
+                }
+            }
+        } else if (active != 0 && node.nPrimitives > 0) {
+            int hitMask = intersectLeaf(node.primitivesOffset, node.nPrimitives, packet, active, hits);
+            found |= hitMask;
+            for (int i = 0; options.closestHitCulling && i < RayPacket::size; i++) {
+                if (hitMask & (1 << i))
+                    tMax[i] = hits[i].t;
+            }
+        } else if (active != 0) {
+            assert(stackSize < int(linearDepth));
+            if (options.closestHitCulling && dirIsNeg[node.axis]) {
+                stack[stackSize++] = {current + 1, active};
+                current = node.secondChildOffset;
+            } else {
+                stack[stackSize++] = {node.secondChildOffset, active};
+                current++;
+            }
+            continue;
+        }
+        if (stackSize == 0)
+            break;
+        stackSize--;
+        current = stack[stackSize].node;
+        active = stack[stackSize].active;
+    }
+    return found;
+}
+
+bool BVH::occludedLinear(const Ray& ray, float tMax) const {
+    TraversalStats& stats = threadTraversalStats;
+    TraversalStack<uint32_t, 64> stack(linearDepth);
+    int stackSize = 0;
+    uint32_t current = 0;
+    while (true) {
+        const LinearBVHNode& node = nodes[current];
+        float tEnter;
+        stats.nodeVisits++;
+        if (rayCastBox(node, ray, tMax, tEnter)) {
+            if (node.nPrimitives > 0) {
+                if (occludedLeaf(node.primitivesOffset, node.nPrimitives, ray, tMax))
+                    return true;
+            } else {
+                assert(stackSize < int(linearDepth));
+                stack[stackSize++] = node.secondChildOffset;
+                current++;
+                continue;
+            }
+        }
+        if (stackSize == 0)
+            break;
+        current = stack[--stackSize];
+    }
+    return false;
+}
+
+// The ray's origin and inverse direction broadcast to every lane.
+struct WideRay {
+    Vec4 origin[3];
+    Vec4 directionInv[3];
+
+    WideRay(const Ray& ray) {
+        for (int axis = 0; axis < 3; axis++) {
+            origin[axis] = Vec4(ray.origin[axis]);
+            directionInv[axis] = Vec4(ray.direction_inv[axis]);
+        }
+    }
+};
+
+// Slab test of one ray against all children of a wide node. Returns a mask
+// of the children hit before tMax and stores their entry distances.
+static inline int rayCastChildren(const BVH::WideBVHNode& node, const WideRay& ray, float tMax, Vec4& tEnter) {
+    Vec4 tExit(tMax);
+    tEnter = Vec4(std::numeric_limits<float>::lowest());
+    for (int axis = 0; axis < 3; axis++) {
+        Vec4 t0 = (Vec4::load(node.pMin[axis]) - ray.origin[axis]) * ray.directionInv[axis];
+        Vec4 t1 = (Vec4::load(node.pMax[axis]) - ray.origin[axis]) * ray.directionInv[axis];
+        tEnter = Vec4::max(tEnter, Vec4::min(t0, t1));
+        tExit = Vec4::min(tExit, Vec4::max(t0, t1));
+    }
+    int validLanes = (1 << node.nChildren) - 1;
+    return Vec4::lessEqual(tEnter, tExit) & Vec4::lessEqual(Vec4(0.f), tExit) & validLanes;
+}
+
+namespace {
+// Pending child of the wide traversal: a wide node, or a leaf's primitive range.
+struct WideStackEntry {
+    uint32_t child;
+    uint32_t nPrimitives;
+    float tEnter;
+};
+}
+
+bool BVH::intersectWide(const Ray& ray, Hit& hit) const {
+    bool found = false;
+    float tMax = options.closestHitCulling ? hit.t : std::numeric_limits<float>::max();
+    WideRay wideRay(ray);
+    TraversalStats& stats = threadTraversalStats;
+    // Every wide node visited pops one entry and pushes at most four.
+    TraversalStack<WideStackEntry, 256> stack(3 * wideDepth + 1);
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, 0};
+    while (stackSize > 0) {
+        WideStackEntry entry = stack[--stackSize];
+        // The closest hit may have moved in front of this child since it was pushed.
+        if (entry.tEnter > tMax)
+            continue;
+        if (entry.nPrimitives > 0) {
+            if (intersectLeaf(entry.child, entry.nPrimitives, ray, hit)) {
+                found = true;
+                if (options.closestHitCulling)
+                    tMax = hit.t;
+            }
+            continue;
+        }
+        const WideBVHNode& node = wide[entry.child];
+        stats.nodeVisits++;
+        Vec4 tEnter4;
+        int hitMask = rayCastChildren(node, wideRay, tMax, tEnter4);
+        alignas(16) float tEnter[4];
+        tEnter4.store(tEnter);
+        // Push the hit children farthest first, so the nearest is popped next.
+        int order[4];
+        int nHits = 0;
+        for (int i = 0; i < node.nChildren; i++) {
+            if (!(hitMask & (1 << i)))
+                continue;
+            int j = nHits++;
+            if (options.closestHitCulling) {
+                for (; j > 0 && tEnter[order[j - 1]] < tEnter[i]; j--)
+                    order[j] = order[j - 1];
+            }
+            order[j] = i;
+        }
+        assert(stackSize + nHits <= int(3 * wideDepth + 1));
+        for (int h = 0; h < nHits; h++) {
+            int i = order[options.closestHitCulling ? h : nHits - 1 - h];
+            stack[stackSize++] = {node.child[i], node.nPrimitives[i], tEnter[i]};
+        }
+    }
+    return found;
+}
+
+bool BVH::occludedWide(const Ray& ray, float tMax) const {
+    WideRay wideRay(ray);
+    TraversalStats& stats = threadTraversalStats;
+    TraversalStack<WideStackEntry, 256> stack(3 * wideDepth + 1);
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, 0};
+    while (stackSize > 0) {
+        WideStackEntry entry = stack[--stackSize];
+        if (entry.nPrimitives > 0) {
+            if (occludedLeaf(entry.child, entry.nPrimitives, ray, tMax))
+                return true;
+            continue;
+        }
+        const WideBVHNode& node = wide[entry.child];
+        stats.nodeVisits++;
+        Vec4 tEnter;
+        int hitMask = rayCastChildren(node, wideRay, tMax, tEnter);
+        assert(stackSize + node.nChildren <= int(3 * wideDepth + 1));
+        for (int i = node.nChildren - 1; i >= 0; i--) {
+            if (hitMask & (1 << i))
+                stack[stackSize++] = {node.child[i], node.nPrimitives[i], 0};
+        }
+    }
+    return false;
 }
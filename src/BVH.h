@@ -1,47 +1,281 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <cstdint>
 #include <ctime>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <utility>
 #include <vector>
 
+#include "Arena.h"
 #include "Bounds3.h"
+#include "Buffer.h"
+#include "IndexedTriangles.h"
 #include "Intersection.h"
 #include "Object.h"
 #include "Ray.h"
+#include "TrianglePacket.h"
 #include "Vector.h"
 
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
+
+// Traversal counters. Each thread counts into its own TraversalStats and
+// periodically folds them into the process-wide totals with flush().
+struct TraversalStats {
+    uint64_t rays = 0;
+    uint64_t nodeVisits = 0;
+    uint64_t primitiveTests = 0;
+
+    void flush();
+};
+inline thread_local TraversalStats threadTraversalStats;
+inline std::atomic<uint64_t> totalRays, totalNodeVisits, totalPrimitiveTests;
+
+inline void TraversalStats::flush() {
+    totalRays += rays;
+    totalNodeVisits += nodeVisits;
+    totalPrimitiveTests += primitiveTests;
+    *this = TraversalStats();
+}
+
+enum class BVHLayout { POINTER, LINEAR, WIDE4 };
+enum class BVHSplitMethod { MEDIAN, SAH, LBVH };
+
+struct BVHOptions {
+    // POINTER keeps the heap-allocated node tree, LINEAR flattens it into a
+    // contiguous depth-first array, WIDE4 collapses it into 4-ary nodes whose
+    // children are tested against a ray with one SIMD slab test.
+    BVHLayout layout = BVHLayout::LINEAR;
+    // MEDIAN splits at the median centroid along the longest axis, SAH picks
+    // the cheapest of bucketCount (2 to 64) binned planes by the surface area
+    // heuristic, LBVH sorts primitives along a Morton curve and splits where the codes
+    // differ, trading tree quality for a much faster build.
+    BVHSplitMethod splitMethod = BVHSplitMethod::SAH;
+    int bucketCount = 12;
+    // Primitives a leaf may hold, 1 to 65535.
+    int maxLeafSize = 4;
+    // Relative costs of visiting a node and testing a primitive.
+    float traversalCost = 0.125f;
+    float intersectionCost = 1.f;
+    // Visit the nearer child first and skip nodes that start beyond the
+    // closest hit found so far. Off restores the plain left-first traversal.
+    bool closestHitCulling = true;
+    // Threads used to build the tree, <= 0 uses std::thread::hardware_concurrency().
+    int buildThreads = 0;
+    // Ranges with at least this many primitives fork their subtrees and reductions
+    // onto other threads. The tree is the same as a serial build.
+    int parallelThreshold = 4096;
+    // Let meshes pack their leaf triangles for SIMD tests (BVH::packTriangles).
+    bool packTriangles = true;
+    // A ray packet that reaches a node with this many active rays or fewer
+    // no longer shares enough work; its rays finish the subtree one by one.
+    // On BVHTraceBench 2 did as well as 1, and 3 or more slowed camera rays.
+    int packetFallbackRays = 1;
+};
+
 class BVH {
 public:
+    // Node of the pointer tree. Nodes live in the BVH's arenas, so they are
+    // never deleted one by one.
     class BVHNode {
     public:
         Bounds3 bounds;
         BVHNode* left;
         BVHNode* right;
-        Object* object;
+        // Leaf primitives are primitives[firstPrim, firstPrim + nPrims).
+        uint32_t firstPrim;
+        uint32_t nPrims;
+        int axis;
 
         BVHNode() {
-            bounds = Bounds3();
-            left   = NULL;
-            right  = NULL;
-            object = NULL;
-        }
-        
-        ~BVHNode() {
-            delete left;
-            left = NULL;
-            delete right;
-            right = NULL;
+            bounds    = Bounds3();
+            left      = NULL;
+            right     = NULL;
+            firstPrim = 0;
+            nPrims    = 0;
+            axis      = 0;
         }
     };
+
+    // Depth-first node of the flattened tree. The first child of an interior
+    // node directly follows it, the second child is stored as an index.
+    struct LinearBVHNode {
+        float pMin[3];
+        float pMax[3];
+        union {
+            uint32_t primitivesOffset;   // leaf
+            uint32_t secondChildOffset;  // interior
+        };
+        uint16_t nPrimitives;  // 0 for interior nodes
+        uint8_t axis;
+        uint8_t pad;
+    };
+    static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode must stay 32 bytes");
+
+    // Node of the 4-wide tree. The child boxes are stored per coordinate
+    // (structure of arrays) so one Vec4 holds the same bound of all children.
+    struct alignas(16) WideBVHNode {
+        float pMin[3][4];
+        float pMax[3][4];
+        // Wide node index for an interior child, first primitive for a leaf.
+        uint32_t child[4];
+        // Primitive count of a leaf child, 0 for an interior child.
+        uint16_t nPrimitives[4];
+        uint8_t nChildren;
+        uint8_t pad[7];
+    };
+    static_assert(sizeof(WideBVHNode) == 128, "WideBVHNode must stay 128 bytes");
     
-    BVH(std::vector<Object*>& objects);
+    BVH(const std::vector<Object*>& objects, const BVHOptions& options = BVHOptions());
+    // A tree over the triangles themselves. Their bounds are only held while
+    // the tree is built, the nodes keep them from then on.
+    BVH(const IndexedTriangles& triangles, const BVHOptions& options = BVHOptions());
+    // A tree over triangles flattened earlier (LINEAR or WIDE4 layout), e.g.
+    // views into a geometry cache. order lists the triangles in leaf order.
+    BVH(const IndexedTriangles& triangles, const BVHOptions& options, Buffer<uint32_t>&& order,
+        Buffer<LinearBVHNode>&& nodes, Buffer<WideBVHNode>&& wide, Buffer<TrianglePacket>&& packets,
+        Buffer<uint32_t>&& leafPackets);
     ~BVH();
     Intersection rayCast(const Ray& ray) const;
+    // Closest-hit query that only updates hit (see Object::intersect); true if
+    // it found a primitive closer than hit.t.
+    bool intersect(const Ray& ray, Hit& hit) const;
+    // intersect for the rays of packet in the lane mask active. In the LINEAR
+    // layout rays that point into the same octant share one traversal; others
+    // are traced one by one. Returns the mask of rays that got a closer hit;
+    // the hits are the same the rays find on their own.
+    int intersect(const RayPacket& packet, int active, Hit hits[]) const;
+    // Any-hit query: true as soon as some primitive blocks the ray before tMax.
+    bool occluded(const Ray& ray, float tMax) const;
+    // Recomputes every node's bounds bottom-up from the current primitive
+    // bounds, keeping the tree topology. Much cheaper than a rebuild, but the
+    // tree gets slower to trace the further primitives move from where they
+    // were at build time. Triangle packets are not updated.
+    void refit();
+    // For trees over triangles only: copies every leaf's triangles into
+    // TrianglePackets, after which leaves are tested four triangles at a time
+    // instead of one by one. triangle gives an object's first vertex and its
+    // two edges from it; trees over IndexedTriangles read them directly.
+    void packTriangles(const std::function<void(const Object*, Vec3& v0, Vec3& e1, Vec3& e2)>& triangle);
+    void packTriangles();
+
+    // Expected cost of a random ray under the surface area heuristic, in
+    // units of the configured traversal and intersection costs.
+    float sahCost() const;
+    int nodeCount() const { return wide.empty() ? int(totalNodes) : int(wide.size()); }
+    const Buffer<LinearBVHNode>& linearNodes() const { return nodes; }
+    const Buffer<WideBVHNode>& wideNodes() const { return wide; }
+    const Buffer<TrianglePacket>& trianglePackets() const { return packets; }
+    const Buffer<uint32_t>& leafPacketOffsets() const { return leafPackets; }
+    // Bytes held by the nodes, the primitive order and any triangle packets.
+    size_t memoryBytes() const {
+        return nodeArenaBytes() + nodes.capacity() * sizeof(LinearBVHNode) +
+               wide.capacity() * sizeof(WideBVHNode) + objects.capacity() * sizeof(Object*) +
+               primitives.capacity() * sizeof(uint32_t) + packets.capacity() * sizeof(TrianglePacket) +
+               leafPackets.capacity() * sizeof(uint32_t);
+    }
+    // Index of every leaf primitive, among the objects or the triangles the
+    // tree was built over, in leaf order.
+    const Buffer<uint32_t>& orderedPrimitives() const { return primitives; }
+    // Heap blocks and bytes of the arenas holding the pointer tree; both 0
+    // once a flattened tree has been built.
+    size_t nodeArenaBlocks() const {
+        size_t blocks = 0;
+        for (const std::unique_ptr<Arena>& arena : nodeArenas)
+            blocks += arena->blockCount();
+        return blocks;
+    }
+    size_t nodeArenaBytes() const {
+        size_t bytes = 0;
+        for (const std::unique_ptr<Arena>& arena : nodeArenas)
+            bytes += arena->bytes();
+        return bytes;
+    }
 private:
+    // Builds over primitiveBounds, which it frees when done.
+    void build();
     //endIdx is exclusive by convention
-    BVHNode* build(std::vector<Object*>& objects, std::vector<Object*>::size_type startIdx, std::vector<Object*>::size_type endIdx);
-    Intersection rayCast(BVHNode* node, const Ray& ray) const;
-    BVHNode* root;
+    BVHNode* build(std::vector<uint32_t>& order, std::vector<uint32_t>::size_type startIdx,
+                   std::vector<uint32_t>::size_type endIdx, int depth, Arena& arena);
+    BVHNode* buildLeaf(std::vector<uint32_t>& order, std::vector<uint32_t>::size_type startIdx,
+                       std::vector<uint32_t>::size_type endIdx, Arena& arena);
+    // Returns the SAH split index of [startIdx, endIdx), or endIdx if a leaf is cheaper.
+    std::vector<uint32_t>::size_type splitSAH(std::vector<uint32_t>& order, std::vector<uint32_t>::size_type startIdx,
+                                              std::vector<uint32_t>::size_type endIdx, int depth,
+                                              const Bounds3& bounds, const Bounds3& centroidBounds, int dim) const;
+    BVHNode* buildLBVH(std::vector<uint32_t>& order, Arena& arena);
+    BVHNode* emitLBVH(std::vector<uint32_t>& order, const std::vector<uint32_t>& mortonCodes,
+                      std::vector<uint32_t>::size_type startIdx, std::vector<uint32_t>::size_type endIdx, int bitIndex,
+                      Arena& arena);
+    // An arena for the nodes built on one thread; kept until freeNodes().
+    Arena& newNodeArena();
+    // Frees the whole pointer tree at once.
+    void freeNodes();
+    template <typename T, typename ChunkFn, typename MergeFn>
+    T reduce(std::vector<uint32_t>::size_type startIdx, std::vector<uint32_t>::size_type endIdx, int depth,
+             ChunkFn chunkFn, MergeFn mergeFn) const;
+    uint32_t flatten(BVHNode* node);
+    // Sets linearDepth and wideDepth from the flattened or wide nodes.
+    void measureDepth();
+    uint32_t collapse(BVHNode* node);
+    Bounds3 refit(BVHNode* node);
+    Bounds3 leafBounds(uint32_t first, uint32_t count) const;
+    // Packs the triangles of every leaf; triangle gives the corners of the
+    // primitive at an index into primitives.
+    void packLeaves(const std::function<void(uint32_t, Vec3& v0, Vec3& e1, Vec3& e2)>& triangle);
+    // Records a hit on the primitive at index i into primitives.
+    void record(Hit& hit, uint32_t i, float t, float u, float v) const;
+    float sahCost(BVHNode* node) const;
+    float sahCost(uint32_t nodeIdx) const;
+    float sahCostWide(uint32_t nodeIdx) const;
+    bool intersect(BVHNode* node, const Ray& ray, const bool dirIsNeg[3], Hit& hit) const;
+    // Single-ray traversal of the subtree at node root.
+    bool intersectLinear(const Ray& ray, Hit& hit, uint32_t root = 0) const;
+    int intersectLinear(const RayPacket& packet, int active, Hit hits[]) const;
+    bool occluded(BVHNode* node, const Ray& ray, float tMax) const;
+    bool occludedLinear(const Ray& ray, float tMax) const;
+    bool intersectWide(const Ray& ray, Hit& hit) const;
+    // Leaf tests over primitives[first, first + count). intersectLeaf returns
+    // true if it found a hit closer than hit.t.
+    bool intersectLeaf(uint32_t first, uint32_t count, const Ray& ray, Hit& hit) const;
+    int intersectLeaf(uint32_t first, uint32_t count, const RayPacket& packet, int active, Hit hits[]) const;
+    bool occludedLeaf(uint32_t first, uint32_t count, const Ray& ray, float tMax) const;
+    // (first primitive, primitive count) of every leaf.
+    void leaves(std::vector<std::pair<uint32_t, uint32_t>>& out) const;
+    bool occludedWide(const Ray& ray, float tMax) const;
+
+    BVHOptions options;
+    BVHNode* root = NULL;
+    std::vector<std::unique_ptr<Arena>> nodeArenas;
+    std::mutex nodeArenaMutex;
+    Buffer<LinearBVHNode> nodes;
+    Buffer<WideBVHNode> wide;
+    // Leaf triangles in groups of four, set up by packTriangles. A leaf
+    // starting at primitive i owns packets from leafPackets[i] on.
+    Buffer<TrianglePacket> packets;
+    Buffer<uint32_t> leafPackets;
+    // What the tree is built over: objects, or triangles if triangles.owner
+    // is set.
+    std::vector<Object*> objects;
+    IndexedTriangles triangles;
+    // Bounds of every primitive, only while the tree is built.
+    std::vector<Bounds3> primitiveBounds;
+    // Leaf primitives in depth-first order.
+    Buffer<uint32_t> primitives;
+    std::atomic<int> totalNodes{0};
+    // Levels of the flattened and of the wide tree, which bound the
+    // traversal stacks.
+    uint32_t linearDepth = 0;
+    uint32_t wideDepth = 0;
+    int buildThreads = 1;
+    int maxForkDepth = 0;
+    static const int maxBuckets = 64;
+    // Flattened and wide nodes count their primitives in 16 bits.
+    static const int maxLeafPrimitives = 65535;
+    std::vector<uint32_t>::size_type leafSize() const {
+        return std::clamp(options.maxLeafSize, 1, maxLeafPrimitives);
+    }
 };
@@ -18,10 +18,28 @@ public:
     
     Bounds3(const Vec3& p) : Bounds3(p, p) {}
     
+    // Empty box, so merging anything into it yields exactly that thing.
     Bounds3() {
         float minNum = std::numeric_limits<float>::lowest();
         float maxNum = std::numeric_limits<float>::max();
-        Bounds3(Vec3(minNum, minNum, minNum), Vec3(maxNum, maxNum, maxNum));
+        pMin = Vec3(maxNum, maxNum, maxNum);
+        pMax = Vec3(minNum, minNum, minNum);
+    }
+
+    float surfaceArea() const {
+        Vec3 d = pMax - pMin;
+        if (d.x < 0 || d.y < 0 || d.z < 0)
+            return 0;
+        return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+    }
+
+    // Position of p relative to the box, (0,0,0) at pMin and (1,1,1) at pMax.
+    Vec3 offset(const Vec3& p) const {
+        Vec3 o = p - pMin;
+        if (pMax.x > pMin.x) o.x /= pMax.x - pMin.x;
+        if (pMax.y > pMin.y) o.y /= pMax.y - pMin.y;
+        if (pMax.z > pMin.z) o.z /= pMax.z - pMin.z;
+        return o;
     }
 
     int longestAxis() const {
@@ -32,28 +50,34 @@ public:
     }
     
     inline bool rayCast(const Ray& ray) const;
+    // Slab test limited to distances up to tMax; tEnter receives the distance
+    // at which the ray enters the box.
+    inline bool rayCast(const Ray& ray, float tMax, float& tEnter) const;
 };
 
 inline bool Bounds3::rayCast(const Ray& ray) const {
-    float tEnter = std::numeric_limits<float>::lowest();
-    float tExit = std::numeric_limits<float>::max();
-    for (int i = 0; i < 3; i++) {
-        float t0 = (pMin[i] - ray.origin[i]) * ray.direction_inv[i];
-        float t1 = (pMax[i] - ray.origin[i]) * ray.direction_inv[i];
-        if (t0 > t1)
-            std::swap(t0, t1);
-        tEnter = fmax(tEnter, t0);
-        tExit = fmin(tExit, t1);
-        if (tExit < .0f || tEnter > tExit)
-            return false;
-    }
-    return true;
+    float tEnter;
+    return rayCast(ray, std::numeric_limits<float>::max(), tEnter);
+}
+
+// All three slabs at once, so the SIMD backend does it without a loop.
+inline bool rayCastSlabs(const Vec3& pMin, const Vec3& pMax, const Ray& ray, float tMax, float& tEnter) {
+    Vec3 t0 = (pMin - ray.origin) * ray.direction_inv;
+    Vec3 t1 = (pMax - ray.origin) * ray.direction_inv;
+    tEnter = Vec3::min(t0, t1).maxComponent();
+    float tExit = std::min(tMax, Vec3::max(t0, t1).minComponent());
+    return tExit >= .0f && tEnter <= tExit;
+}
+
+inline bool Bounds3::rayCast(const Ray& ray, float tMax, float& tEnter) const {
+    return rayCastSlabs(pMin, pMax, ray, tMax, tEnter);
 }
 
 inline Bounds3 merge(const Bounds3& b1, const Bounds3& b2) {
     Bounds3 ret;
     ret.pMin = Vec3::min(b1.pMin, b2.pMin);
     ret.pMax = Vec3::max(b1.pMax, b2.pMax);
+    ret.centroid = 0.5 * ret.pMin + 0.5 * ret.pMax;
     return ret;
 }
 
@@ -61,5 +85,6 @@ inline Bounds3 merge(const Bounds3& b, const Vec3& p) {
     Bounds3 ret;
     ret.pMin = Vec3::min(b.pMin, p);
     ret.pMax = Vec3::max(b.pMax, p);
+    ret.centroid = 0.5 * ret.pMin + 0.5 * ret.pMax;
     return ret;
 }
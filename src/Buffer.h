@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Contiguous array that either owns its elements or views memory owned
+// elsewhere, such as a mapped geometry cache. Growing a view first copies it
+// into owned storage.
+template <typename T>
+class Buffer {
+   public:
+    Buffer() = default;
+    Buffer(std::vector<T>&& elements) : owned(std::move(elements)) { sync(); }
+    // A view of count elements at items, which must outlive the buffer.
+    Buffer(T* items, size_t count) : items(items), count(count) {}
+
+    Buffer(Buffer&& other) noexcept { *this = std::move(other); }
+    Buffer& operator=(Buffer&& other) noexcept {
+        bool view = other.isView();
+        owned = std::move(other.owned);
+        if (view) {
+            items = other.items;
+            count = other.count;
+        } else {
+            sync();
+        }
+        other.owned.clear();
+        other.sync();
+        return *this;
+    }
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+
+    bool isView() const { return items != owned.data(); }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    // Owned capacity, or the viewed size.
+    size_t capacity() const { return isView() ? count : owned.capacity(); }
+    T* data() { return items; }
+    const T* data() const { return items; }
+    T& operator[](size_t i) { return items[i]; }
+    const T& operator[](size_t i) const { return items[i]; }
+    T* begin() { return items; }
+    T* end() { return items + count; }
+    const T* begin() const { return items; }
+    const T* end() const { return items + count; }
+    T& back() { return items[count - 1]; }
+
+    void reserve(size_t n) {
+        own();
+        owned.reserve(n);
+        sync();
+    }
+    void clear() {
+        owned.clear();
+        sync();
+    }
+    void assign(size_t n, const T& value) {
+        owned.assign(n, value);
+        sync();
+    }
+    void push_back(const T& value) {
+        own();
+        owned.push_back(value);
+        sync();
+    }
+    template <typename... Args>
+    T& emplace_back(Args&&... args) {
+        own();
+        owned.emplace_back(std::forward<Args>(args)...);
+        sync();
+        return owned.back();
+    }
+
+   private:
+    void own() {
+        if (isView()) {
+            owned.assign(items, items + count);
+            sync();
+        }
+    }
+    void sync() {
+        items = owned.data();
+        count = owned.size();
+    }
+
+    std::vector<T> owned;
+    T* items = nullptr;
+    size_t count = 0;
+};
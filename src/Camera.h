@@ -7,7 +7,7 @@ class Camera {
 public:
     Camera() {}
     Camera(const Vec3& p, const Vec3& f, const Vec3& u, float fov, float aspect)
-    :pos(p), front(f), up(u) {
+    :pos(p), front(f), up(u), fov(fov), aspect(aspect) {
         float half_height = tan(deg2rad(fov) * 0.5);
         float half_width = aspect * half_height;
         right = normalize(cross(front, up));
@@ -18,6 +18,19 @@ public:
         vertical = half_height * up * 2;
     }
 
+    // Same lens and up vector, placed at position and aimed at target.
+    Camera lookAt(const Vec3& position, const Vec3& target) const {
+        return Camera(position, target - position, up, fov, aspect);
+    }
+
+    const Vec3& getPosition() const {
+        return pos;
+    }
+
+    const Vec3& getFront() const {
+        return front;
+    }
+
     Ray getRay(float x, float y) const {
         return Ray(pos, normalize(bottomLeft + x * horizontal + y * vertical - pos));
     }
@@ -30,4 +43,6 @@ private:
     Vec3 up;
     Vec3 front;
     Vec3 right;
+    float fov;
+    float aspect;
 };
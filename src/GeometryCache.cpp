@@ -0,0 +1,208 @@
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <utility>
+#include <vector>
+
+#include "GeometryCache.h"
+
+// Sections start on cache line boundaries, which covers the alignment of
+// every stored type.
+static const uint64_t sectionAlignment = 64;
+static const char magic[8] = {'R', 'T', 'G', 'E', 'O', 'M', 0, 0};
+static const uint32_t elementSizes[GeometryCache::SECTION_COUNT] = {
+    sizeof(Vec3), sizeof(Vec2), sizeof(uint32_t), sizeof(uint32_t), sizeof(BVH::LinearBVHNode),
+    sizeof(BVH::WideBVHNode), sizeof(TrianglePacket), sizeof(uint32_t)};
+
+static uint64_t mix(uint64_t h, uint64_t value) {
+    h = (h ^ value) * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 32);
+}
+
+static uint64_t hashBytes(const char* data, size_t size, uint64_t h) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = mix(h, word);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    return mix(mix(h, tail), size);
+}
+
+static uint64_t floatBits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+uint64_t GeometryCache::key(const std::string& filename, ObjLoader loader, bool bvhEnable,
+                            const BVHOptions& options) {
+    MappedFile source(filename);
+    if (source.data == NULL)
+        return 0;
+    source.adviseSequential();
+    uint64_t h = hashBytes(source.data, source.size, version);
+    // Element sizes differ between SIMD backends, whose caches must not mix.
+    h = mix(h, sizeof(Vec3));
+    h = mix(h, sizeof(Vec2));
+    // objl splits polygons differently; the other readers give the same mesh.
+    h = mix(h, loader == ObjLoader::OBJL);
+    h = mix(h, bvhEnable);
+    if (bvhEnable) {
+        // Only settings that change the tree; thread counts do not.
+        h = mix(h, uint64_t(options.layout));
+        h = mix(h, uint64_t(options.splitMethod));
+        h = mix(h, options.bucketCount);
+        h = mix(h, options.maxLeafSize);
+        h = mix(h, floatBits(options.traversalCost));
+        h = mix(h, floatBits(options.intersectionCost));
+        h = mix(h, options.packTriangles);
+    }
+    // 0 means "no key".
+    return h != 0 ? h : 1;
+}
+
+std::string GeometryCache::path(const std::string& directory, const std::string& filename, uint64_t key) {
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+    return (std::filesystem::path(directory) / std::filesystem::path(filename).stem()).string() + "-" + hex + ".rtgc";
+}
+
+bool GeometryCache::open(const std::string& path, uint64_t key) {
+    file = std::make_unique<MappedFile>(path, true);
+    bool valid = file->data != NULL && file->size >= sizeof(Header);
+    if (valid) {
+        const Header* h = header();
+        valid = memcmp(h->magic, magic, sizeof(magic)) == 0 && h->version == version &&
+                h->sectionCount == SECTION_COUNT && h->key == key;
+        for (int s = 0; valid && s < SECTION_COUNT; s++) {
+            const SectionEntry& entry = h->sections[s];
+            valid = entry.elementSize == elementSizes[s] && entry.offset % sectionAlignment == 0 && entry.offset <= file->size &&
+                    entry.count * entry.elementSize <= file->size - entry.offset;
+        }
+        // Only meshes with triangles are cached.
+        valid = valid && h->sections[INDICES].count > 0 && contentsValid();
+    }
+    if (!valid)
+        file.reset();
+    return valid;
+}
+
+bool GeometryCache::contentsValid() const {
+    Buffer<uint32_t> indices = view<uint32_t>(INDICES);
+    uint64_t numVertices = count(POSITIONS);
+    if (indices.size() % 3 != 0 || count(ST_COORDINATES) != numVertices)
+        return false;
+    for (uint32_t index : indices) {
+        if (index >= numVertices)
+            return false;
+    }
+
+    // Without a BVH the tree sections are all empty.
+    Buffer<uint32_t> order = view<uint32_t>(PRIMITIVE_ORDER);
+    if (order.size() == 0)
+        return count(LINEAR_NODES) == 0 && count(WIDE_NODES) == 0 && count(TRIANGLE_PACKETS) == 0 &&
+               count(LEAF_PACKETS) == 0;
+    uint64_t numTriangles = indices.size() / 3;
+    if (order.size() != numTriangles)
+        return false;
+    std::vector<bool> seen(numTriangles, false);
+    for (uint32_t face : order) {
+        if (face >= numTriangles || seen[face])
+            return false;
+        seen[face] = true;
+    }
+
+    // Children are stored after their parents, which also rules out cycles.
+    std::vector<std::pair<uint64_t, uint64_t>> leaves;
+    Buffer<BVH::LinearBVHNode> nodes = view<BVH::LinearBVHNode>(LINEAR_NODES);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const BVH::LinearBVHNode& node = nodes[i];
+        if (node.nPrimitives > 0)
+            leaves.emplace_back(node.primitivesOffset, node.nPrimitives);
+        else if (i + 1 >= nodes.size() || node.secondChildOffset <= i + 1 || node.secondChildOffset >= nodes.size())
+            return false;
+    }
+    Buffer<BVH::WideBVHNode> wide = view<BVH::WideBVHNode>(WIDE_NODES);
+    for (size_t i = 0; i < wide.size(); i++) {
+        const BVH::WideBVHNode& node = wide[i];
+        if (node.nChildren == 0 || node.nChildren > 4)
+            return false;
+        for (int lane = 0; lane < node.nChildren; lane++) {
+            if (node.nPrimitives[lane] > 0)
+                leaves.emplace_back(node.child[lane], node.nPrimitives[lane]);
+            else if (node.child[lane] <= i || node.child[lane] >= wide.size())
+                return false;
+        }
+    }
+    for (const std::pair<uint64_t, uint64_t>& leaf : leaves) {
+        if (leaf.first + leaf.second > order.size())
+            return false;
+    }
+
+    // Packets are found through the first primitive of each leaf.
+    Buffer<TrianglePacket> packets = view<TrianglePacket>(TRIANGLE_PACKETS);
+    if (packets.size() == 0)
+        return count(LEAF_PACKETS) == 0;
+    Buffer<uint32_t> leafPackets = view<uint32_t>(LEAF_PACKETS);
+    if (leafPackets.size() != order.size())
+        return false;
+    for (const std::pair<uint64_t, uint64_t>& leaf : leaves) {
+        if (leafPackets[leaf.first] + (leaf.second + 3) / 4 > packets.size())
+            return false;
+    }
+    for (const TrianglePacket& packet : packets) {
+        for (uint32_t primitive : packet.primitive) {
+            if (primitive >= order.size())
+                return false;
+        }
+    }
+    return true;
+}
+
+bool GeometryCache::write(const std::string& path, uint64_t key, const SectionData (&sections)[SECTION_COUNT]) {
+    Header h = {};
+    memcpy(h.magic, magic, sizeof(magic));
+    h.version = version;
+    h.sectionCount = SECTION_COUNT;
+    h.key = key;
+    uint64_t offset = sizeof(Header);
+    for (int s = 0; s < SECTION_COUNT; s++) {
+        offset = (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+        assert(sections[s].elementSize == elementSizes[s] || sections[s].count == 0);
+        h.sections[s] = {offset, sections[s].count, elementSizes[s], 0};
+        offset += sections[s].count * sections[s].elementSize;
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+    std::string temporary =
+        path + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        static const char zeros[sectionAlignment] = {};
+        uint64_t written = sizeof(h);
+        for (int s = 0; s < SECTION_COUNT; s++) {
+            out.write(zeros, h.sections[s].offset - written);
+            out.write(static_cast<const char*>(sections[s].data), sections[s].count * sections[s].elementSize);
+            written = h.sections[s].offset + sections[s].count * sections[s].elementSize;
+        }
+        if (!out) {
+            out.close();
+            std::filesystem::remove(temporary, error);
+            return false;
+        }
+    }
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "BVH.h"
+#include "Buffer.h"
+#include "MappedFile.h"
+#include "ObjParser.h"
+
+// Versioned binary copy of a mesh's vertex and index buffers and its
+// flattened BVH, so later runs map it instead of parsing the OBJ file and
+// rebuilding the tree. Every cache file is named after its key, a hash of the
+// source file's contents and of every setting that changes what is stored,
+// so an edited model or different BVH options simply miss.
+class GeometryCache {
+   public:
+    enum Section {
+        POSITIONS,
+        ST_COORDINATES,
+        INDICES,
+        // Face index of every BVH primitive, in leaf order.
+        PRIMITIVE_ORDER,
+        LINEAR_NODES,
+        WIDE_NODES,
+        TRIANGLE_PACKETS,
+        LEAF_PACKETS,
+        SECTION_COUNT
+    };
+
+    // Bumped whenever the file layout or anything stored in it changes.
+    static const uint32_t version = 1;
+
+    // Cache key of filename's mesh read by loader and built with these
+    // settings, 0 if the file cannot be read.
+    static uint64_t key(const std::string& filename, ObjLoader loader, bool bvhEnable, const BVHOptions& options);
+    // Cache file for key in directory.
+    static std::string path(const std::string& directory, const std::string& filename, uint64_t key);
+
+    // Maps the cache file at path. False if it is missing, truncated, of
+    // another version, for another key, holds no triangles or any index or
+    // offset in it points outside its section.
+    bool open(const std::string& path, uint64_t key);
+
+    // Section s viewed in place in the mapping, which is copy-on-write so the
+    // view may be modified (e.g. by BVH::refit). Valid while this cache lives.
+    template <typename T>
+    Buffer<T> view(Section s) const {
+        const SectionEntry& entry = header()->sections[s];
+        assert(entry.elementSize == sizeof(T) || entry.count == 0);
+        return Buffer<T>(reinterpret_cast<T*>(file->data + entry.offset), entry.count);
+    }
+    uint64_t count(Section s) const { return header()->sections[s].count; }
+
+    struct SectionData {
+        const void* data = NULL;
+        uint64_t count = 0;
+        uint32_t elementSize = 0;
+    };
+    template <typename T>
+    static SectionData section(const T* data, size_t count) {
+        return {data, count, sizeof(T)};
+    }
+    // Writes a cache file. It is written under a temporary name and renamed,
+    // so concurrent runs never map a half written file.
+    static bool write(const std::string& path, uint64_t key, const SectionData (&sections)[SECTION_COUNT]);
+
+   private:
+    struct SectionEntry {
+        uint64_t offset;
+        uint64_t count;
+        uint32_t elementSize;
+        uint32_t pad;
+    };
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t sectionCount;
+        uint64_t key;
+        SectionEntry sections[SECTION_COUNT];
+    };
+
+    const Header* header() const { return reinterpret_cast<const Header*>(file->data); }
+    // Whether every index and offset stored in the sections is in range, so
+    // a damaged file cannot make traversal read outside them.
+    bool contentsValid() const;
+
+    std::unique_ptr<MappedFile> file;
+};
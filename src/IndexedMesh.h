@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "Vector.h"
+
+// A triangle mesh as vertex buffers plus three vertex indices per triangle.
+struct IndexedMesh {
+    std::vector<Vec3> positions;
+    std::vector<Vec2> stCoordinates;
+    std::vector<uint32_t> indices;
+};
+
+// Fills an IndexedMesh corner by corner, merging corners that share both
+// position and texture coordinate. Vertices are numbered in the order they
+// first appear, so the same corner sequence always gives the same mesh.
+class IndexedMeshBuilder {
+   public:
+    explicit IndexedMeshBuilder(IndexedMesh& mesh) : mesh(mesh) {}
+
+    // Index of the vertex (position, st), appended to the mesh if it is new.
+    uint32_t vertex(const Vec3& position, const Vec2& st) {
+        Key key = {{position.x, position.y, position.z, st.x, st.y}};
+        auto inserted = unique.emplace(key, uint32_t(mesh.positions.size()));
+        if (inserted.second) {
+            mesh.positions.push_back(position);
+            mesh.stCoordinates.push_back(st);
+        }
+        return inserted.first->second;
+    }
+
+    void addCorner(const Vec3& position, const Vec2& st) {
+        mesh.indices.push_back(vertex(position, st));
+    }
+
+    // Makes room for vertexCount vertices and indexCount indices, so adding
+    // corners up to those counts allocates nothing but table entries.
+    void reserve(size_t vertexCount, size_t indexCount) {
+        mesh.positions.reserve(vertexCount);
+        mesh.stCoordinates.reserve(vertexCount);
+        mesh.indices.reserve(indexCount);
+        unique.reserve(vertexCount);
+    }
+
+    // Approximate heap bytes of the lookup table (not of the mesh).
+    size_t memoryBytes() const {
+        return memoryBytes(unique.size(), true);
+    }
+    // The same once the table holds vertexCount vertices, its buckets grown
+    // by the doubling of rehashes or, if exact, by reserve(vertexCount, ...).
+    size_t memoryBytes(size_t vertexCount, bool exact) const {
+        size_t needed = size_t(std::ceil(vertexCount / unique.max_load_factor()));
+        size_t buckets = std::max<size_t>(unique.bucket_count(), 1);
+        if (exact)
+            buckets = std::max(buckets, needed);
+        while (buckets < needed)
+            buckets *= 2;
+        return vertexCount * (sizeof(Key) + sizeof(uint32_t) + 2 * sizeof(void*)) + buckets * sizeof(void*);
+    }
+
+   private:
+    struct Key {
+        float v[5];
+        bool operator==(const Key& other) const { return memcmp(v, other.v, sizeof(v)) == 0; }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            uint32_t bits[5];
+            memcpy(bits, key.v, sizeof(bits));
+            size_t h = 0;
+            for (uint32_t b : bits)
+                h = h * 0x9E3779B97F4A7C15ull + b;
+            return h;
+        }
+    };
+
+    IndexedMesh& mesh;
+    std::unordered_map<Key, uint32_t, KeyHash> unique;
+};
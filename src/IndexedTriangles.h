@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+
+#include "Bounds3.h"
+#include "Intersection.h"
+#include "Ray.h"
+#include "Vector.h"
+
+// Möller Trumbore intersection algorithm
+inline bool rayTriangleIntersect(const Vec3& v0, const Vec3& e1, const Vec3& e2, const Vec3& orig,
+                                 const Vec3& dir, float& tnear, float& u, float& v) {
+    Vec3 s0 = orig - v0;
+    Vec3 s1 = cross(dir, e2);
+    Vec3 s2 = cross(s0, e1);
+    // res: (tnear, u, v)
+    Vec3 res = (1 / dot(s1, e1)) * Vec3(dot(s2, e2), dot(s1, s0), dot(s2, dir));
+    tnear = res.x;
+    u = res.y;
+    v = res.z;
+    return res.x >= .0f && res.y >= .0f && res.z >= .0f && res.y + res.z <= 1.0f;
+}
+
+// Triangles stored as a vertex buffer plus three vertex indices each, which a
+// BVH is built over without an Object per triangle. The buffers stay owned by
+// owner, the object hits are recorded against; a hit's primitive is the index
+// of the triangle.
+struct IndexedTriangles {
+    const Vec3* vertices = NULL;
+    const uint32_t* indices = NULL;
+    uint32_t count = 0;
+    Object* owner = NULL;
+
+    void corners(uint32_t i, Vec3& v0, Vec3& v1, Vec3& v2) const {
+        const uint32_t* corner = &indices[i * 3];
+        v0 = vertices[corner[0]];
+        v1 = vertices[corner[1]];
+        v2 = vertices[corner[2]];
+    }
+
+    Bounds3 bounds(uint32_t i) const {
+        Vec3 v0, v1, v2;
+        corners(i, v0, v1, v2);
+        return merge(Bounds3(v0, v1), v2);
+    }
+
+    // Back faces are culled, like Triangle::intersect.
+    bool intersect(uint32_t i, const Ray& ray, Hit& hit) const {
+        Vec3 v0, v1, v2;
+        corners(i, v0, v1, v2);
+        Vec3 e1 = v1 - v0, e2 = v2 - v0;
+        if (dot(ray.direction, cross(e1, e2)) > 0)
+            return false;
+        float u, v, t = 0;
+        if (!rayTriangleIntersect(v0, e1, e2, ray.origin, ray.direction, t, u, v) || t >= hit.t)
+            return false;
+        hit.record(t, u, v, owner, i);
+        return true;
+    }
+
+    bool occluded(uint32_t i, const Ray& ray, float tMax) const {
+        Vec3 v0, v1, v2;
+        corners(i, v0, v1, v2);
+        Vec3 e1 = v1 - v0, e2 = v2 - v0;
+        if (dot(ray.direction, cross(e1, e2)) > 0)
+            return false;
+        float u, v, t = 0;
+        return rayTriangleIntersect(v0, e1, e2, ray.origin, ray.direction, t, u, v) && t < tMax;
+    }
+};
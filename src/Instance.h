@@ -0,0 +1,98 @@
+#pragma once
+
+#include <memory>
+
+#include "Object.h"
+#include "Transform.h"
+#include "Triangle.h"
+
+// A placement of a shared MeshTriangle. The mesh, its BVH and its buffers
+// exist once however many instances use them; each instance only adds its
+// transforms and world-space bounds. Rays are taken into object space,
+// intersected with the mesh's BVH, and the hit is mapped back.
+//
+// Instances are not sampled as lights, so an emissive instance only
+// contributes where a bounce happens to hit it.
+class Instance : public Object {
+public:
+    Instance(std::shared_ptr<MeshTriangle> mesh, const Transform& objectToWorld)
+        : Object(mesh->material), mesh(std::move(mesh)) {
+        setTransform(objectToWorld);
+    }
+
+    // Moves the instance. Its bounds change, so the scene BVH has to be
+    // refit or rebuilt (Scene::updateBVH) before the next ray is traced.
+    void setTransform(const Transform& transform) {
+        objectToWorld = transform;
+        worldToObject = transform.inverse();
+        const Bounds3& b = mesh->getBounds();
+        Bounds3 bounds;
+        for (int corner = 0; corner < 8; corner++) {
+            Vec3 p(corner & 1 ? b.pMax.x : b.pMin.x, corner & 2 ? b.pMax.y : b.pMin.y,
+                   corner & 4 ? b.pMax.z : b.pMin.z);
+            bounds = merge(bounds, objectToWorld.point(p));
+        }
+        bounding_box = bounds;
+    }
+
+    const Transform& getTransform() const {
+        return objectToWorld;
+    }
+
+    // The object-space direction is not renormalized, so distances along
+    // it are the same as along the world-space ray. The hit is the mesh's;
+    // its normal is mapped back when the surface is evaluated.
+    bool intersect(const Ray& ray, Hit& hit) override {
+        if (!mesh->intersect(objectRay(ray), hit))
+            return false;
+        hit.worldToObject = &worldToObject;
+        return true;
+    }
+
+    // Every ray is taken into object space on its own; the packet stays as
+    // coherent as it was.
+    int intersect(const RayPacket& packet, int active, Hit hits[]) override {
+        RayPacket local = packet;
+        for (int i = 0; i < RayPacket::size; i++) {
+            if (active & (1 << i))
+                local.set(i, objectRay(packet.ray(i)));
+        }
+        int found = mesh->intersect(local, active, hits);
+        for (int i = 0; i < RayPacket::size; i++) {
+            if (found & (1 << i))
+                hits[i].worldToObject = &worldToObject;
+        }
+        return found;
+    }
+
+    bool occluded(const Ray& ray, float tMax) override {
+        return mesh->occluded(objectRay(ray), tMax);
+    }
+
+    // Hits report the mesh as their object, so these are not reached
+    // through an intersection.
+    void getSurfaceProperties(const Vec3& P, const Vec3& I, const Vec2& uv, uint32_t primitive,
+                              Vec3& N, Vec2& st) const override {
+    }
+
+    Vec3 evalDiffuseColor(const Vec2& st) const override {
+        return mesh->evalDiffuseColor(st);
+    }
+
+    float getArea() const override {
+        return 0;
+    }
+
+    void sample(Sampler& sampler, Vec3& position, Vec3& normal, float& pdf) const override {
+        pdf = 0;
+    }
+
+private:
+    Ray objectRay(const Ray& ray) const {
+        return Ray(worldToObject.point(ray.origin), worldToObject.vector(ray.direction));
+    }
+
+    std::shared_ptr<MeshTriangle> mesh;
+    Transform objectToWorld;
+    Transform worldToObject;
+};
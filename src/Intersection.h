@@ -1,9 +1,38 @@
 #pragma once
 
+#include <cstdint>
+#include <limits>
+
 #include "Material.h"
 #include "Vector.h"
 class Object;
 class Sphere;
+class Transform;
+
+// What traversal keeps of the closest hit found so far: its distance along
+// the ray, the primitive and the barycentric coordinates on it. Candidates
+// are compared and replaced as Hits; only the one that is left gets its full
+// Intersection worked out (Object::rayCast, surfaceIntersection).
+struct Hit {
+    float t = std::numeric_limits<float>::max();
+    float u = 0, v = 0;
+    // Which part of obj was hit, e.g. the triangle of a mesh; 0 for objects
+    // made of one piece.
+    uint32_t primitive = 0;
+    Object* obj = NULL;
+    // Set when obj was reached through an Instance, to bring its normal back
+    // to world space.
+    const Transform* worldToObject = NULL;
+
+    void record(float t, float u, float v, Object* obj, uint32_t primitive = 0) {
+        this->t = t;
+        this->u = u;
+        this->v = v;
+        this->primitive = primitive;
+        this->obj = obj;
+        worldToObject = NULL;
+    }
+};
 
 struct Intersection {
     Intersection() {
@@ -18,6 +47,8 @@ struct Intersection {
     Vec3 coords;
     Vec3 normal;
     Vec2 uv;
+    // Texture coordinates at coords.
+    Vec2 st;
     double distance;
     Object* obj;
     Material* material;
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#include <iterator>
+#include <vector>
+#endif
+
+// A whole file in memory: a private mapping where mmap exists, a plain read
+// elsewhere. Writes through data never reach the file; with copyOnWrite the
+// mapping is writable and only the pages written to are copied.
+class MappedFile {
+   public:
+    explicit MappedFile(const std::string& filename, bool copyOnWrite = false) {
+#ifndef _WIN32
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            int protection = copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ;
+            void* mapped = mmap(NULL, st.st_size, protection, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                data = static_cast<char*>(mapped);
+                size = st.st_size;
+            }
+        }
+        close(fd);
+#else
+        std::ifstream file(filename, std::ios::binary);
+        if (!file)
+            return;
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (data != NULL)
+            munmap(data, size);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Hints that the file will be read front to back once.
+    void adviseSequential() {
+#ifndef _WIN32
+        if (data != NULL)
+            madvise(data, size, MADV_SEQUENTIAL);
+#endif
+    }
+
+    char* data = NULL;
+    size_t size = 0;
+
+#ifdef _WIN32
+   private:
+    std::vector<char> buffer;
+#endif
+};
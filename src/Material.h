@@ -12,8 +12,8 @@ public:
     Vec3 kd = Vec3(0.6f);
 
     inline Material(MaterialType t = LAMBERTIAN, Vec3 c = Vec3(1, 1, 1));
-    inline MaterialType getType();
-    inline Vec3 getColor();
+    inline MaterialType getType() const;
+    inline Vec3 getColor() const;
 private:
      MaterialType type;
      Vec3 color;
@@ -24,9 +24,9 @@ Material::Material(MaterialType t, Vec3 c) {
     color = c;
 }
 
-MaterialType Material::getType() {
+MaterialType Material::getType() const {
     return type;
 }
-Vec3 Material::getColor() {
+Vec3 Material::getColor() const {
     return color;
 }
@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+#include "MappedFile.h"
+#include "ObjParser.h"
+#include "Scheduler.h"
+
+namespace {
+
+// One face corner as written in the file. Negative OBJ indices count back
+// from the vertices read so far, which a chunk only knows relative to its own
+// start; those are kept relative until the chunk offsets are known.
+struct Corner {
+    enum : uint8_t { RELATIVE_POSITION = 1, RELATIVE_ST = 2, NO_ST = 4 };
+    int32_t position;
+    int32_t st;
+    uint8_t flags;
+};
+
+struct Chunk {
+    const char* begin;
+    const char* end;
+    bool valid = true;
+    std::vector<Vec3> positions;
+    std::vector<Vec2> stCoordinates;
+    // Three corners per triangle.
+    std::vector<Corner> corners;
+    // Number of positions and texture coordinates in the chunks before this one.
+    size_t positionOffset = 0;
+    size_t stOffset = 0;
+    // The chunk's triangles merged on their own, and the index of the first
+    // one in the whole mesh.
+    IndexedMesh local;
+    size_t indexOffset = 0;
+};
+
+inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline const char* skipBlanks(const char* p, const char* end) {
+    while (p < end && isBlank(*p))
+        p++;
+    return p;
+}
+
+inline bool parseFloat(const char*& p, const char* end, float& value) {
+    p = skipBlanks(p, end);
+    // from_chars rejects the leading '+' that stof accepts.
+    if (p < end && *p == '+')
+        p++;
+    std::from_chars_result result = std::from_chars(p, end, value);
+    p = result.ptr;
+    return result.ec == std::errc();
+}
+
+inline bool parseIndex(const char*& p, const char* end, int32_t& value) {
+    std::from_chars_result result = std::from_chars(p, end, value);
+    p = result.ptr;
+    return result.ec == std::errc() && value != 0;
+}
+
+// Turns a 1-based or negative OBJ index into a 0-based one, relative to the
+// start of the chunk if it was negative.
+inline int32_t resolveIndex(int32_t index, size_t count, uint8_t relativeFlag, uint8_t& flags) {
+    if (index > 0)
+        return index - 1;
+    flags |= relativeFlag;
+    return int32_t(count) + index;
+}
+
+bool parseFace(const char* p, const char* end, Chunk& chunk) {
+    Corner first, previous;
+    int count = 0;
+    while (true) {
+        p = skipBlanks(p, end);
+        if (p == end)
+            break;
+        Corner corner = {0, 0, 0};
+        int32_t index;
+        if (!parseIndex(p, end, index))
+            return false;
+        corner.position = resolveIndex(index, chunk.positions.size(), Corner::RELATIVE_POSITION, corner.flags);
+        corner.flags |= Corner::NO_ST;
+        if (p < end && *p == '/') {
+            p++;
+            if (p < end && *p != '/') {
+                if (!parseIndex(p, end, index))
+                    return false;
+                corner.flags &= ~Corner::NO_ST;
+                corner.st = resolveIndex(index, chunk.stCoordinates.size(), Corner::RELATIVE_ST, corner.flags);
+            }
+            // The normal index is not used.
+            if (p < end && *p == '/') {
+                p++;
+                if (!parseIndex(p, end, index))
+                    return false;
+            }
+        }
+        if (p < end && !isBlank(*p))
+            return false;
+        if (count == 0) {
+            first = corner;
+        } else if (count >= 2) {
+            chunk.corners.push_back(first);
+            chunk.corners.push_back(previous);
+            chunk.corners.push_back(corner);
+        }
+        previous = corner;
+        count++;
+    }
+    return count >= 3;
+}
+
+void parseChunk(Chunk& chunk) {
+    const char* p = chunk.begin;
+    while (p < chunk.end && chunk.valid) {
+        const char* lineEnd = static_cast<const char*>(memchr(p, '\n', chunk.end - p));
+        if (lineEnd == NULL)
+            lineEnd = chunk.end;
+        p = skipBlanks(p, lineEnd);
+        if (lineEnd - p >= 2 && p[0] == 'v' && isBlank(p[1])) {
+            const char* field = p + 1;
+            Vec3 position;
+            chunk.valid = parseFloat(field, lineEnd, position.x) && parseFloat(field, lineEnd, position.y) &&
+                          parseFloat(field, lineEnd, position.z);
+            chunk.positions.push_back(position);
+        } else if (lineEnd - p >= 3 && p[0] == 'v' && p[1] == 't' && isBlank(p[2])) {
+            const char* field = p + 2;
+            Vec2 st;
+            chunk.valid = parseFloat(field, lineEnd, st.x) && parseFloat(field, lineEnd, st.y);
+            chunk.stCoordinates.push_back(st);
+        } else if (lineEnd - p >= 2 && p[0] == 'f' && isBlank(p[1])) {
+            chunk.valid = parseFace(p + 1, lineEnd, chunk);
+        }
+        p = lineEnd + 1;
+    }
+}
+
+// Looks a chunk's corner up in the vertex arrays of the whole file so far.
+inline bool resolveCorner(const Corner& corner, const Chunk& chunk, const std::vector<Vec3>& positions,
+                          const std::vector<Vec2>& stCoordinates, Vec3& position, Vec2& st) {
+    int64_t p = corner.position;
+    if (corner.flags & Corner::RELATIVE_POSITION)
+        p += chunk.positionOffset;
+    if (p < 0 || p >= int64_t(positions.size()))
+        return false;
+    position = positions[p];
+    st = Vec2(0, 0);
+    if (!(corner.flags & Corner::NO_ST)) {
+        int64_t t = corner.st;
+        if (corner.flags & Corner::RELATIVE_ST)
+            t += chunk.stOffset;
+        if (t < 0 || t >= int64_t(stCoordinates.size()))
+            return false;
+        st = stCoordinates[t];
+    }
+    return true;
+}
+
+// Merges the chunk's corners into the chunk's own indexed mesh.
+void mergeChunk(Chunk& chunk, const std::vector<Vec3>& positions, const std::vector<Vec2>& stCoordinates) {
+    IndexedMeshBuilder builder(chunk.local);
+    chunk.local.indices.reserve(chunk.corners.size());
+    for (const Corner& corner : chunk.corners) {
+        Vec3 position;
+        Vec2 st;
+        if (!resolveCorner(corner, chunk, positions, stCoordinates, position, st)) {
+            chunk.valid = false;
+            return;
+        }
+        builder.addCorner(position, st);
+    }
+}
+
+}  // namespace
+
+bool loadObj(const std::string& filename, IndexedMesh& mesh, int threadCount) {
+    mesh = IndexedMesh();
+    MappedFile file(filename);
+    if (file.data == NULL)
+        return false;
+    file.adviseSequential();
+
+    // Enough chunks to balance the threads, none so small that the per-chunk
+    // merge dominates. A small file is a single chunk parsed on this thread.
+    int threads = threadCount > 0 ? threadCount : std::max(1u, std::thread::hardware_concurrency());
+    const size_t minChunkBytes = 256 * 1024;
+    size_t chunkCount = std::max<size_t>(1, std::min<size_t>(threads * 4, file.size / minChunkBytes));
+    TaskScheduler scheduler(int(std::min<size_t>(threads, chunkCount)));
+    auto forEachChunk = [&](const std::function<void(int)>& task) {
+        if (chunkCount == 1)
+            task(0);
+        else
+            scheduler.run(int(chunkCount), task);
+    };
+    std::vector<Chunk> chunks(chunkCount);
+    const char* fileEnd = file.data + file.size;
+    for (size_t c = 0; c < chunkCount; c++) {
+        const char* begin = c == 0 ? file.data : chunks[c - 1].end;
+        const char* end = fileEnd;
+        if (c + 1 < chunkCount) {
+            end = std::max<const char*>(begin, file.data + file.size * (c + 1) / chunkCount);
+            const char* newline = static_cast<const char*>(memchr(end, '\n', fileEnd - end));
+            end = newline != NULL ? newline + 1 : fileEnd;
+        }
+        chunks[c].begin = begin;
+        chunks[c].end = end;
+    }
+
+    forEachChunk([&](int c) { parseChunk(chunks[c]); });
+
+    size_t positionCount = 0, stCount = 0;
+    for (Chunk& chunk : chunks) {
+        if (!chunk.valid)
+            return false;
+        chunk.positionOffset = positionCount;
+        chunk.stOffset = stCount;
+        positionCount += chunk.positions.size();
+        stCount += chunk.stCoordinates.size();
+    }
+    std::vector<Vec3> positions(positionCount);
+    std::vector<Vec2> stCoordinates(stCount);
+    forEachChunk([&](int c) {
+        Chunk& chunk = chunks[c];
+        std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + chunk.positionOffset);
+        std::copy(chunk.stCoordinates.begin(), chunk.stCoordinates.end(), stCoordinates.begin() + chunk.stOffset);
+        std::vector<Vec3>().swap(chunk.positions);
+        std::vector<Vec2>().swap(chunk.stCoordinates);
+    });
+
+    // Each chunk merges its own corners in parallel. Folding the chunks'
+    // vertices into the mesh in chunk order then numbers every vertex by its
+    // first appearance in the file, as a serial pass over all corners would.
+    forEachChunk([&](int c) {
+        mergeChunk(chunks[c], positions, stCoordinates);
+        std::vector<Corner>().swap(chunks[c].corners);
+    });
+    IndexedMeshBuilder builder(mesh);
+    size_t indexCount = 0;
+    std::vector<std::vector<uint32_t>> remap(chunkCount);
+    for (size_t c = 0; c < chunkCount; c++) {
+        Chunk& chunk = chunks[c];
+        if (!chunk.valid)
+            return false;
+        chunk.indexOffset = indexCount;
+        indexCount += chunk.local.indices.size();
+        remap[c].resize(chunk.local.positions.size());
+        for (size_t i = 0; i < chunk.local.positions.size(); i++)
+            remap[c][i] = builder.vertex(chunk.local.positions[i], chunk.local.stCoordinates[i]);
+    }
+    mesh.indices.resize(indexCount);
+    forEachChunk([&](int c) {
+        const std::vector<uint32_t>& indices = chunks[c].local.indices;
+        for (size_t i = 0; i < indices.size(); i++)
+            mesh.indices[chunks[c].indexOffset + i] = remap[c][indices[i]];
+    });
+    return !mesh.indices.empty();
+}
+
+bool loadObjStreaming(const std::string& filename, IndexedMesh& mesh, size_t memoryLimit, size_t& peakBytes) {
+    mesh = IndexedMesh();
+    peakBytes = 0;
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file)
+        return false;
+    size_t fileSize = file.tellg();
+    file.seekg(0);
+
+    // The read block takes an eighth of the ceiling; the scratch arrays parsed
+    // from it take about as much again, leaving the rest for the mesh.
+    const size_t minBlockBytes = 64 * 1024, maxBlockBytes = 4 * 1024 * 1024;
+    size_t blockBytes = memoryLimit > 0 ? std::clamp(memoryLimit / 8, minBlockBytes, maxBlockBytes) : maxBlockBytes;
+    // One byte more than a small file, so it is seen to end in the first block.
+    blockBytes = std::min(blockBytes, fileSize + 1);
+    std::vector<char> block(blockBytes);
+    std::vector<Vec3> positions;
+    std::vector<Vec2> stCoordinates;
+    IndexedMeshBuilder builder(mesh);
+    Chunk chunk;
+    size_t carried = 0;
+    while (true) {
+        file.read(block.data() + carried, block.size() - carried);
+        size_t filled = carried + file.gcount();
+        bool last = filled < block.size();
+        // Parse up to the last complete line; the rest starts the next block.
+        const char* end = block.data() + filled;
+        if (!last) {
+            while (end > block.data() && end[-1] != '\n')
+                end--;
+            if (end == block.data())
+                return false;  // a line longer than the whole block
+        }
+        chunk.begin = block.data();
+        chunk.end = end;
+        parseChunk(chunk);
+        if (!chunk.valid)
+            return false;
+
+        // Check the ceiling before the merge grows anything, counting every
+        // corner as a possible new vertex. Arrays grow by doubling, as
+        // push_back does, unless that would not fit; then just what this
+        // block can need is reserved.
+        size_t positionCount = positions.size() + chunk.positions.size();
+        size_t stCount = stCoordinates.size() + chunk.stCoordinates.size();
+        size_t vertexCount = mesh.positions.size() + chunk.corners.size();
+        size_t indexCount = mesh.indices.size() + chunk.corners.size();
+        bool exact = false;
+        auto grown = [&](size_t capacity, size_t count) {
+            if (exact)
+                return std::max(capacity, count);
+            while (capacity < count)
+                capacity = std::max<size_t>(1, 2 * capacity);
+            return capacity;
+        };
+        auto projectedBytes = [&]() {
+            return block.capacity() + chunk.positions.capacity() * sizeof(Vec3) +
+                   chunk.stCoordinates.capacity() * sizeof(Vec2) + chunk.corners.capacity() * sizeof(Corner) +
+                   grown(positions.capacity(), positionCount) * sizeof(Vec3) +
+                   grown(stCoordinates.capacity(), stCount) * sizeof(Vec2) +
+                   grown(mesh.positions.capacity(), vertexCount) * (sizeof(Vec3) + sizeof(Vec2)) +
+                   grown(mesh.indices.capacity(), indexCount) * sizeof(uint32_t) +
+                   builder.memoryBytes(vertexCount, exact);
+        };
+        size_t bytes = projectedBytes();
+        if (memoryLimit > 0 && bytes > memoryLimit) {
+            exact = true;
+            bytes = projectedBytes();
+        }
+        peakBytes = std::max(peakBytes, bytes);
+        if (memoryLimit > 0 && bytes > memoryLimit) {
+            std::cerr << filename << ": loading needs more than the " << memoryLimit / 1024
+                      << " KB memory ceiling" << std::endl;
+            return false;
+        }
+        positions.reserve(grown(positions.capacity(), positionCount));
+        stCoordinates.reserve(grown(stCoordinates.capacity(), stCount));
+        if (exact)
+            builder.reserve(vertexCount, indexCount);
+
+        chunk.positionOffset = positions.size();
+        chunk.stOffset = stCoordinates.size();
+        positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+        stCoordinates.insert(stCoordinates.end(), chunk.stCoordinates.begin(), chunk.stCoordinates.end());
+        for (const Corner& corner : chunk.corners) {
+            Vec3 position;
+            Vec2 st;
+            if (!resolveCorner(corner, chunk, positions, stCoordinates, position, st))
+                return false;
+            builder.addCorner(position, st);
+        }
+        chunk.positions.clear();
+        chunk.stCoordinates.clear();
+        chunk.corners.clear();
+        if (last)
+            break;
+        carried = block.data() + filled - end;
+        memmove(block.data(), end, carried);
+    }
+    return !mesh.indices.empty();
+}
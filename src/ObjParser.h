@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "IndexedMesh.h"
+
+// OBJ readers MeshTriangle can use: objl::Loader, loadObj or loadObjStreaming.
+enum class ObjLoader { OBJL, PARALLEL, STREAMING };
+
+// Loads every face of a Wavefront OBJ file into mesh, without going through
+// objl. The file is memory mapped and cut at line boundaries into chunks that
+// are parsed on threadCount threads (<= 0: one per core); polygons are fan
+// triangulated and normals ignored. Corners are merged exactly like
+// IndexedMeshBuilder does for the triangles objl lists, so both give the same
+// mesh for a file of triangles; objl cuts larger polygons differently.
+// Returns false if the file cannot be read or is malformed.
+bool loadObj(const std::string& filename, IndexedMesh& mesh, int threadCount = 0);
+
+// Loads filename into mesh in one serial pass, reading it block by block and
+// merging every face into mesh as soon as it is parsed, so no full copy of
+// the file or of its faces is ever held. Only the raw vertex arrays, the
+// mesh and its vertex lookup table grow with the file. Fails before a block
+// is merged if that could take the loader's memory, estimated from its
+// arrays, past memoryLimit bytes (0: no limit); peakBytes receives the
+// largest estimate seen. Gives the same mesh as loadObj.
+bool loadObjStreaming(const std::string& filename, IndexedMesh& mesh, size_t memoryLimit, size_t& peakBytes);
@@ -3,6 +3,9 @@
 #include "Bounds3.h"
 #include "Intersection.h"
 #include "Ray.h"
+#include "RayPacket.h"
+#include "Sampler.h"
+#include "Transform.h"
 #include "Vector.h"
 #include "global.h"
 
@@ -10,12 +13,60 @@ class Object {
 public:
     Object(Material* m = NULL) : material(m) {}
     virtual ~Object() {}
-    virtual Intersection rayCast(const Ray& ray) = 0;
-    virtual void getSurfaceProperties(const Vec3&, const Vec3&,
-                                      const Vec2&, Vec3 &, Vec2&) const = 0;
+    // Records a hit in hit if the ray meets the object closer than hit.t;
+    // returns whether it did. Only the distance, the primitive and its
+    // barycentric coordinates are kept, see getSurfaceProperties for the rest.
+    virtual bool intersect(const Ray& ray, Hit& hit) = 0;
+    // intersect for every ray of packet in the lane mask active, hits[i]
+    // belonging to lane i. Returns the mask of rays that got a closer hit.
+    // Objects with a BVH of their own trace the packet through it; the others
+    // test the rays one at a time.
+    virtual int intersect(const RayPacket& packet, int active, Hit hits[]);
+    // The closest hit with its surface data filled in.
+    inline Intersection rayCast(const Ray& ray);
+    // Whether anything blocks the ray between its origin and distance tMax
+    // (in units of ray.direction). Stops at the first hit.
+    virtual bool occluded(const Ray& ray, float tMax) = 0;
+    // Shading normal N and texture coordinates st at the hit point P of a ray
+    // with direction I, uv and primitive being what intersect recorded.
+    virtual void getSurfaceProperties(const Vec3& P, const Vec3& I, const Vec2& uv, uint32_t primitive,
+                                      Vec3& N, Vec2& st) const = 0;
     virtual Vec3 evalDiffuseColor(const Vec2&) const = 0;
-    Bounds3 getBounds() { return bounding_box; };
+    virtual float getArea() const = 0;
+    // Picks a point uniformly over the surface; pdf is per unit area.
+    virtual void sample(Sampler& sampler, Vec3& position, Vec3& normal, float& pdf) const = 0;
+    const Bounds3& getBounds() const { return bounding_box; };
     Material* material;
 protected:
     Bounds3 bounding_box;
 };
+
+// The full record of a hit intersect found for ray, evaluated once, after
+// traversal has settled on it.
+inline Intersection surfaceIntersection(const Ray& ray, const Hit& hit) {
+    Intersection inter;
+    inter.happened = true;
+    inter.coords = ray.origin + hit.t * ray.direction;
+    inter.uv = Vec2(hit.u, hit.v);
+    inter.distance = hit.t;
+    inter.obj = hit.obj;
+    inter.material = hit.obj->material;
+    hit.obj->getSurfaceProperties(inter.coords, ray.direction, inter.uv, hit.primitive, inter.normal, inter.st);
+    if (hit.worldToObject != NULL)
+        inter.normal = normalize(hit.worldToObject->transposedVector(inter.normal));
+    return inter;
+}
+
+inline int Object::intersect(const RayPacket& packet, int active, Hit hits[]) {
+    int found = 0;
+    for (int i = 0; i < RayPacket::size; i++) {
+        if ((active & (1 << i)) && intersect(packet.ray(i), hits[i]))
+            found |= 1 << i;
+    }
+    return found;
+}
+
+inline Intersection Object::rayCast(const Ray& ray) {
+    Hit hit;
+    return intersect(ray, hit) ? surfaceIntersection(ray, hit) : Intersection();
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <limits>
+
+#include "Ray.h"
+#include "Vector.h"
+
+// Eight rays traced together through a BVH, e.g. the camera rays of a 4x2
+// pixel block. Stored as structure of arrays, so box and triangle tests run
+// on four rays at a time. Which lanes hold a ray is passed alongside as a
+// bit mask (bit i for lane i).
+struct alignas(16) RayPacket {
+    static const int size = 8;
+    static const int allRays = (1 << size) - 1;
+
+    float origin[3][size];
+    float direction[3][size];
+    float directionInv[3][size];
+
+    void set(int lane, const Ray& ray) {
+        for (int axis = 0; axis < 3; axis++) {
+            origin[axis][lane] = ray.origin[axis];
+            direction[axis][lane] = ray.direction[axis];
+            directionInv[axis][lane] = ray.direction_inv[axis];
+        }
+    }
+
+    // The ray in lane, for tracing it on its own.
+    Ray ray(int lane) const {
+        return Ray(Vec3(origin[0][lane], origin[1][lane], origin[2][lane]),
+                   Vec3(direction[0][lane], direction[1][lane], direction[2][lane]));
+    }
+
+    // Whether the rays of active all point into the same octant, i.e. agree
+    // on the sign of every direction component.
+    bool sameOctant(int active) const {
+        for (int axis = 0; axis < 3; axis++) {
+            int negative = 0;
+            for (int first = 0; first < size; first += 4) {
+                Vec4 inv = Vec4::load(&directionInv[axis][first]);
+                negative |= Vec4::less(inv, Vec4(0.f)) << first;
+            }
+            negative &= active;
+            if (negative != 0 && negative != active)
+                return false;
+        }
+        return true;
+    }
+
+    // The lanes of active whose ray enters the box [pMin, pMax] before its
+    // own tMax. The same slab test as rayCastSlabs, four lanes at a time.
+    int rayCastBox(const float pMin[3], const float pMax[3], const float tMax[size], int active) const {
+        int hitMask = 0;
+        for (int first = 0; first < size; first += 4) {
+            if (((active >> first) & 0xF) == 0)
+                continue;
+            Vec4 tEnter(std::numeric_limits<float>::lowest());
+            Vec4 tExit = Vec4::load(&tMax[first]);
+            for (int axis = 0; axis < 3; axis++) {
+                Vec4 o = Vec4::load(&origin[axis][first]);
+                Vec4 inv = Vec4::load(&directionInv[axis][first]);
+                Vec4 t0 = (Vec4(pMin[axis]) - o) * inv;
+                Vec4 t1 = (Vec4(pMax[axis]) - o) * inv;
+                tEnter = Vec4::max(tEnter, Vec4::min(t0, t1));
+                tExit = Vec4::min(tExit, Vec4::max(t0, t1));
+            }
+            hitMask |= (Vec4::lessEqual(tEnter, tExit) & Vec4::lessEqual(Vec4(0.f), tExit)) << first;
+        }
+        return hitMask & active;
+    }
+};
+
+// Number of rays in a lane mask.
+inline int rayCount(int mask) {
+    int count = 0;
+    for (; mask != 0; mask &= mask - 1)
+        count++;
+    return count;
+}
@@ -1,27 +1,100 @@
+#include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include "Renderer.h"
 #include "Scene.h"
+#include "Scheduler.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-void Renderer::Render(const Scene& scene, int sampleCount) {
-    unsigned char data[scene.width * scene.height * 3];
-    int m = 0;
-    for (uint32_t j = 0; j < scene.height; ++j) {
-        for (uint32_t i = 0; i < scene.width; ++i) {
-            Vec3 color = Vec3();
-            for (int _ = 0; _ < sampleCount; _++) {
-                float y = 1 - (j + rand_n1_1()) / (float)scene.height;
-                float x = (i + rand_n1_1()) / (float)scene.width;
-                color += scene.rayCastColor(scene.camera.getRay(x, y), 0);
+void Renderer::RenderTile(const Scene& scene, int sampleCount, int tileIdx, unsigned char* data,
+                          PrimaryRayStats& primaryStats) const {
+    int tilesX = (scene.width + tileSize - 1) / tileSize;
+    int x0 = (tileIdx % tilesX) * tileSize;
+    int y0 = (tileIdx / tilesX) * tileSize;
+    int x1 = std::min(x0 + tileSize, scene.width);
+    int y1 = std::min(y0 + tileSize, scene.height);
+    // Pixels go in blocks of 4x2, one camera ray per pixel and sample. The
+    // closest hits of a block's rays are found first, together as a RayPacket
+    // or one by one, and every ray is then shaded from its hit.
+    const int blockWidth = 4, blockHeight = RayPacket::size / blockWidth;
+    uint64_t primaryRays = 0;
+    std::chrono::steady_clock::duration primaryTime(0);
+    for (int by = y0; by < y1; by += blockHeight) {
+        for (int bx = x0; bx < x1; bx += blockWidth) {
+            Vec3 color[RayPacket::size];
+            for (int s = 0; s < sampleCount; s++) {
+                std::optional<Sampler> samplers[RayPacket::size];
+                RayPacket packet;
+                int active = 0;
+                for (int lane = 0; lane < RayPacket::size; lane++) {
+                    int i = bx + lane % blockWidth, j = by + lane / blockWidth;
+                    if (i >= x1 || j >= y1)
+                        continue;
+                    Sampler& sampler = samplers[lane].emplace(j * scene.width + i, s, seed);
+                    float y = 1 - (j + sampler.n1_1()) / (float)scene.height;
+                    float x = (i + sampler.n1_1()) / (float)scene.width;
+                    packet.set(lane, scene.camera.getRay(x, y));
+                    active |= 1 << lane;
+                }
+                Hit hits[RayPacket::size];
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                if (rayPackets) {
+                    scene.intersect(packet, active, hits);
+                } else {
+                    for (int lane = 0; lane < RayPacket::size; lane++) {
+                        if (active & (1 << lane))
+                            scene.intersect(packet.ray(lane), hits[lane]);
+                    }
+                }
+                primaryTime += std::chrono::steady_clock::now() - start;
+                primaryRays += rayCount(active);
+                for (int lane = 0; lane < RayPacket::size; lane++) {
+                    if (active & (1 << lane))
+                        color[lane] += scene.radiance(packet.ray(lane), hits[lane], *samplers[lane]);
+                }
             }
-            for (int k = 0; k < 3; k++) {
-                data[m++] = (unsigned char)(255 * clamp(0, 1, color[k] / sampleCount));
+            for (int lane = 0; lane < RayPacket::size; lane++) {
+                int i = bx + lane % blockWidth, j = by + lane / blockWidth;
+                if (i >= x1 || j >= y1)
+                    continue;
+                unsigned char* pixel = data + (j * scene.width + i) * 3;
+                for (int k = 0; k < 3; k++) {
+                    pixel[k] = (unsigned char)(255 * clamp(0, 1, color[lane][k] / sampleCount));
+                }
             }
         }
-        updateProgress(j / (float)scene.height);
     }
-    updateProgress(1.f);
-    stbi_write_png("output.png", scene.width, scene.height, 3, data, 0);
+    primaryStats.rays += primaryRays;
+    primaryStats.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(primaryTime).count();
+    threadTraversalStats.flush();
+}
+
+void Renderer::Render(const Scene& scene, int sampleCount, int threadCount, const std::string& filename) {
+    std::vector<unsigned char> data(scene.width * scene.height * 3);
+    int tilesX = (scene.width + tileSize - 1) / tileSize;
+    int tilesY = (scene.height + tileSize - 1) / tileSize;
+
+    // Tiles cover disjoint pixels, so workers write into data without locking.
+    totalRays = totalNodeVisits = totalPrimitiveTests = 0;
+    PrimaryRayStats primaryStats;
+    TaskScheduler scheduler(threadCount);
+    scheduler.run(tilesX * tilesY,
+                  [&](int tile) { RenderTile(scene, sampleCount, tile, data.data(), primaryStats); },
+                  updateProgress);
+    std::cout << std::endl;
+    scheduler.printStats(std::cout);
+    uint64_t rays = std::max<uint64_t>(1, totalRays);
+    std::cout << totalRays << " rays, " << totalNodeVisits << " BVH node visits ("
+              << totalNodeVisits / (double)rays << " per ray), " << totalPrimitiveTests
+              << " primitive tests (" << totalPrimitiveTests / (double)rays << " per ray)" << std::endl;
+    double primarySeconds = std::max<uint64_t>(1, primaryStats.nanoseconds) * 1e-9;
+    std::cout << "Camera rays " << (rayPackets ? "in packets of " + std::to_string(RayPacket::size) : "one by one")
+              << ": " << primaryStats.rays << " rays, " << primaryStats.rays / primarySeconds * 1e-6
+              << " Mrays/s per thread" << std::endl;
+    stbi_write_png(filename.c_str(), scene.width, scene.height, 3, data.data(), 0);
 }
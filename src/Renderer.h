@@ -1,8 +1,34 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <string>
+
 #include "Scene.h"
 
 class Renderer {
    public:
-    void Render(const Scene& scene, int sampleCount);
+    // Edge length in pixels of the square tiles handed to worker threads.
+    int tileSize = 16;
+    // Mixed into every pixel's Sampler; renders with equal seeds are identical.
+    uint64_t seed = 0;
+    // Find the closest hits of camera rays a RayPacket at a time rather than
+    // ray by ray. The image is the same either way.
+    bool rayPackets = true;
+
+    // threadCount <= 0 uses std::thread::hardware_concurrency(). The image is
+    // written to filename as PNG.
+    void Render(const Scene& scene, int sampleCount, int threadCount = 0,
+                const std::string& filename = "output.png");
+
+   private:
+    // Camera rays traced and the time spent finding their closest hits,
+    // summed over all threads.
+    struct PrimaryRayStats {
+        std::atomic<uint64_t> rays{0};
+        std::atomic<uint64_t> nanoseconds{0};
+    };
+
+    void RenderTile(const Scene& scene, int sampleCount, int tileIdx, unsigned char* data,
+                    PrimaryRayStats& primaryStats) const;
 };
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+
+#include "Vector.h"
+
+// Per-sample random number source backed by PCG32 (pcg-random.org).
+// A sampler is derived only from the pixel, the sample index and the
+// render seed, so every pixel can be reproduced on its own regardless of
+// the thread or order it is rendered in.
+class Sampler {
+public:
+    Sampler(uint32_t pixel, uint32_t sampleIdx, uint64_t seed = 0) {
+        // Splitmix the starting state so neighbouring sample indices do not
+        // start out correlated; the pixel selects the PCG stream.
+        uint64_t initState = mix((uint64_t(sampleIdx) << 32 | pixel) ^ mix(seed));
+        uint64_t initSeq = uint64_t(pixel) ^ (seed << 32);
+        state = 0;
+        inc = (initSeq << 1) | 1;
+        nextUInt();
+        state += initState;
+        nextUInt();
+    }
+
+    uint32_t nextUInt() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t xorShifted = uint32_t(((old >> 18) ^ old) >> 27);
+        uint32_t rot = uint32_t(old >> 59);
+        return (xorShifted >> rot) | (xorShifted << ((32 - rot) & 31));
+    }
+
+    // Uniform in [0, 1).
+    float get1D() {
+        return (nextUInt() >> 8) * 0x1p-24f;
+    }
+
+    Vec2 get2D() {
+        float x = get1D();
+        return Vec2(x, get1D());
+    }
+
+    // Uniform in [-1, 1).
+    float n1_1() {
+        return 2 * get1D() - 1;
+    }
+
+private:
+    static uint64_t mix(uint64_t z) {
+        z += 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t state;
+    uint64_t inc;
+};
@@ -1,44 +1,232 @@
+#include <algorithm>
+
 #include "Scene.h"
 
 Scene::~Scene() {
     delete bvh;
-    for (Object* object : objects) {
+    for (Object* object : heapObjects) {
         delete object;
     }
     objects.clear();
 }
 
-Intersection Scene::traverse(const Ray& ray) const{
-    Intersection intersection;
+bool Scene::traverse(const Ray& ray, Hit& hit) const{
+    bool found = false;
+    for (Object* object : objects)
+        found |= object->intersect(ray, hit);
+    return found;
+}
+
+void Scene::buildBVH() {
+    lights.clear();
     for (Object* object : objects) {
-        Intersection tmp = object->rayCast(ray);
-        if (tmp.distance < intersection.distance) {
-            intersection = tmp;
-        }
+        if (object->material != NULL && object->material->getType() == LIGHT && object->getArea() > 0)
+            lights.push_back(object);
+    }
+    if (bvhEnable) {
+        delete bvh;
+        this->bvh = new BVH(objects, bvhOptions);
+        std::cout << "Scene: " << objects.size() << " objects, BVH " << bvh->nodeCount()
+                  << " nodes, SAH cost " << bvh->sahCost() << std::endl;
     }
-    return intersection;
 }
 
-void Scene::buildBVH() {
-    if (bvhEnable)
-        this->bvh = new BVH(objects);
+void Scene::updateBVH(bool refit) {
+    if (bvh == NULL)
+        return;
+    if (refit) {
+        bvh->refit();
+    } else {
+        delete bvh;
+        bvh = new BVH(objects, bvhOptions);
+    }
+}
+
+bool Scene::intersect(const Ray &ray, Hit &hit) const {
+    threadTraversalStats.rays++;
+    return bvhEnable ? this->bvh->intersect(ray, hit) : traverse(ray, hit);
 }
 
 Intersection Scene::rayCast(const Ray &ray) const {
+    Hit hit;
+    return intersect(ray, hit) ? surfaceIntersection(ray, hit) : Intersection();
+}
+
+Intersection Scene::rayCast(const Ray &ray, const Hit *primary) const {
+    if (primary == NULL)
+        return rayCast(ray);
+    return primary->obj != NULL ? surfaceIntersection(ray, *primary) : Intersection();
+}
+
+void Scene::intersect(const RayPacket &packet, int active, Hit hits[]) const {
+    threadTraversalStats.rays += rayCount(active);
+    if (bvhEnable) {
+        bvh->intersect(packet, active, hits);
+        return;
+    }
+    for (int i = 0; i < RayPacket::size; i++) {
+        if (active & (1 << i))
+            traverse(packet.ray(i), hits[i]);
+    }
+}
+
+bool Scene::occluded(const Ray &ray, float tMax) const {
+    threadTraversalStats.rays++;
     if (bvhEnable)
-        return this->bvh->rayCast(ray);
-    return traverse(ray);
+        return this->bvh->occluded(ray, tMax);
+    for (Object* object : objects) {
+        if (object->occluded(ray, tMax))
+            return true;
+    }
+    return false;
+}
+
+static Vec3 emission(const Material *material) {
+    return material->kd * material->getColor();
+}
+
+static float powerHeuristic(float pdf, float otherPdf) {
+    return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
+
+// Cosine-weighted direction around N; the pdf is dot(dir, N) / pi.
+static Vec3 sampleCosineHemisphere(const Vec3 &N, Sampler &sampler) {
+    float r = sqrtf(sampler.get1D());
+    float phi = 2 * M_PI * sampler.get1D();
+    float x = r * cosf(phi), y = r * sinf(phi);
+    float z = sqrtf(std::max(0.f, 1 - x * x - y * y));
+    Vec3 T = fabsf(N.x) > fabsf(N.y) ? Vec3(N.z, 0, -N.x) : Vec3(0, N.z, -N.y);
+    T = normalize(T);
+    Vec3 B = cross(N, T);
+    return normalize(T * x + B * y + N * z);
+}
+
+// Solid angle density of reaching lightPos on light from P through light sampling.
+float Scene::lightPdf(const Object *light, const Vec3 &P, const Vec3 &lightPos, const Vec3 &lightN) const {
+    // Emitters outside the light list (e.g. instances) are never light sampled.
+    if (std::find(lights.begin(), lights.end(), light) == lights.end())
+        return 0;
+    Vec3 d = lightPos - P;
+    float dist2 = dot(d, d);
+    float cosLight = fabsf(dot(lightN, normalize(d)));
+    if (cosLight <= 0)
+        return 0;
+    return dist2 / (cosLight * light->getArea() * lights.size());
+}
+
+// One light sample for the diffuse surface at P, weighted against BSDF sampling.
+Vec3 Scene::sampleLight(const Vec3 &P, const Vec3 &N, const Vec3 &albedo, Sampler &sampler) const {
+    int idx = std::min(int(sampler.get1D() * lights.size()), int(lights.size()) - 1);
+    const Object *light = lights[idx];
+    Vec3 lightPos, lightN;
+    float areaPdf;
+    light->sample(sampler, lightPos, lightN, areaPdf);
+    Vec3 d = lightPos - P;
+    float dist = d.abs();
+    Vec3 wi = d / dist;
+    float cosSurface = dot(N, wi);
+    float cosLight = -dot(lightN, wi);
+    if (cosSurface <= 0 || cosLight <= 0)
+        return Vec3(0);
+    if (occluded(Ray(P + N * EPSILON, wi), dist - 2 * EPSILON))
+        return Vec3(0);
+    float pdf = lightPdf(light, P, lightPos, lightN);
+    float weight = powerHeuristic(pdf, cosSurface / M_PI);
+    return albedo / M_PI * emission(light->material) * (cosSurface * weight / pdf);
+}
+
+Vec3 Scene::radiance(const Ray &ray, Sampler &sampler) const {
+    if (integrator == Integrator::PATH)
+        return tracePath(ray, sampler);
+    return rayCastColor(ray, 0, sampler);
+}
+
+Vec3 Scene::radiance(const Ray &ray, const Hit &primary, Sampler &sampler) const {
+    if (integrator == Integrator::PATH)
+        return tracePath(ray, sampler, &primary);
+    return rayCastColor(ray, 0, sampler, 0, &primary);
+}
+
+// Offset a new ray origin off the surface, to the side the ray leaves through.
+static Vec3 offsetOrigin(const Vec3 &P, const Vec3 &N, const Vec3 &dir) {
+    return dot(dir, N) < 0 ? P - N * EPSILON : P + N * EPSILON;
+}
+
+// Same surfaces as rayCastColor, but every hit continues a single path whose
+// contribution so far is carried in throughput, so a sample costs O(maxDepth).
+Vec3 Scene::tracePath(const Ray &cameraRay, Sampler &sampler, const Hit *primary) const {
+    Vec3 color(0), throughput(1);
+    Ray ray = cameraRay;
+    float bsdfPdf = 0;
+    for (int depth = 0; depth <= maxDepth; depth++) {
+        Intersection intersection = rayCast(ray, depth == 0 ? primary : NULL);
+        if (!intersection.happened) {
+            color += throughput * backgroundColor;
+            break;
+        }
+        const Vec2 &st = intersection.st;
+        const Vec3 &P = intersection.coords;
+        const Vec3 &normal = intersection.normal;
+        Material *material = intersection.material;
+        if (material->getType() == LIGHT) {
+            Vec3 Le = intersection.obj->evalDiffuseColor(st) * material->kd;
+            if (bsdfPdf > 0)
+                Le = Le * powerHeuristic(bsdfPdf, lightPdf(intersection.obj, ray.origin, P, normal));
+            color += throughput * Le;
+            break;
+        }
+        Vec3 dir;
+        bsdfPdf = 0;
+        switch (material->getType()) {
+            case TRANSPARENT: {
+                // Choosing reflection with probability kr cancels the kr weight,
+                // so the throughput is unchanged either way.
+                float kr;
+                fresnel(ray.direction, normal, material->ior, kr);
+                if (kr >= 1 || sampler.get1D() < kr)
+                    dir = normalize(reflect(ray.direction, normal));
+                else
+                    dir = normalize(refract(ray.direction, normal, material->ior));
+                break;
+            }
+            case METAL: {
+                dir = reflect(ray.direction, normal);
+                throughput = throughput * intersection.obj->evalDiffuseColor(st) * material->kr;
+                break;
+            }
+            case LAMBERTIAN: {
+                Vec3 N = dot(ray.direction, normal) > 0 ? -normal : normal;
+                Vec3 albedo = intersection.obj->evalDiffuseColor(st) * material->kd;
+                bool sampleLights = directLighting && !lights.empty();
+                if (sampleLights)
+                    color += throughput * sampleLight(P, N, albedo, sampler);
+                dir = sampleCosineHemisphere(N, sampler);
+                bsdfPdf = sampleLights ? dot(dir, N) / M_PI : 0;
+                throughput = throughput * albedo;
+                break;
+            }
+            default:
+                break;
+        }
+        if (depth >= rouletteDepth) {
+            float survive = std::min(0.95f, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+            if (sampler.get1D() >= survive)
+                break;
+            throughput = throughput / survive;
+        }
+        ray = Ray(offsetOrigin(P, normal, dir), dir);
+    }
+    return color;
 }
 
-Vec3 Scene::rayCastColor(const Ray &ray, int depth) const {
+Vec3 Scene::rayCastColor(const Ray &ray, int depth, Sampler &sampler, float bsdfPdf, const Hit *primary) const {
     if (depth > this->maxDepth) {
         return Vec3(0.0, 0.0, 0.0);
     }
-    Intersection intersection = rayCast(ray);
+    Intersection intersection = rayCast(ray, primary);
     Vec3 color = this->backgroundColor;
     if (intersection.happened) {
-        Vec2 st;
-        intersection.obj->getSurfaceProperties(intersection.coords, ray.direction, intersection.uv, intersection.normal, st);
+        const Vec2 &st = intersection.st;
         switch (intersection.material->getType()) {
             case TRANSPARENT: {
                 Vec3 reflectDir = normalize(reflect(ray.direction, intersection.normal));
@@ -50,11 +238,14 @@ Vec3 Scene::rayCastColor(const Ray &ray, int depth) const {
                                                  ? intersection.coords - intersection.normal * EPSILON
                                                  : intersection.coords + intersection.normal * EPSILON;
                 Vec3 reflectColor =
-                    rayCastColor(Ray(reflectPos, reflectDir), depth + 1);
-                Vec3 refractColor =
-                    rayCastColor(Ray(refractPos, refractDir), depth + 1);
+                    rayCastColor(Ray(reflectPos, reflectDir), depth + 1, sampler);
                 float kr;
                 fresnel(ray.direction, intersection.normal, intersection.material->ior, kr);
+                // On total internal reflection refract() yields no direction, so
+                // there is nothing to trace on the transmitted side.
+                Vec3 refractColor = kr < 1
+                    ? rayCastColor(Ray(refractPos, refractDir), depth + 1, sampler)
+                    : Vec3(0);
                 color = reflectColor * kr + refractColor * (1 - kr);
                 break;
             }
@@ -63,19 +254,29 @@ Vec3 Scene::rayCastColor(const Ray &ray, int depth) const {
                 Vec3 reflectPos = (dot(reflectDir, intersection.normal) < 0)
                                                  ? intersection.coords - intersection.normal * EPSILON
                                                  : intersection.coords + intersection.normal * EPSILON;
-                color = intersection.obj->evalDiffuseColor(st) * rayCastColor(Ray(reflectPos, reflectDir), depth + 1) * intersection.material->kr;
+                color = intersection.obj->evalDiffuseColor(st) * rayCastColor(Ray(reflectPos, reflectDir), depth + 1, sampler) * intersection.material->kr;
                 break;
             }
             case LAMBERTIAN: {
-                Vec3 diffDir = intersection.coords + intersection.normal + Vec3(rand_n1_1(), rand_n1_1(), rand_n1_1());
-                Vec3 diffPos = (dot(diffDir, intersection.normal) < 0)
-                                 ? intersection.coords - intersection.normal * EPSILON
-                                 : intersection.coords + intersection.normal * EPSILON;
-                color = intersection.obj->evalDiffuseColor(st) * rayCastColor(Ray(diffPos, diffDir), depth + 1) * intersection.material->kd;
+                Vec3 N = dot(ray.direction, intersection.normal) > 0 ? -intersection.normal : intersection.normal;
+                Vec3 albedo = intersection.obj->evalDiffuseColor(st) * intersection.material->kd;
+                bool sampleLights = directLighting && !lights.empty();
+                color = sampleLights ? sampleLight(intersection.coords, N, albedo, sampler) : Vec3(0);
+                // With a cosine-weighted bounce, BRDF * cos / pdf is just the albedo.
+                Vec3 diffDir = sampleCosineHemisphere(N, sampler);
+                Vec3 diffPos = intersection.coords + N * EPSILON;
+                float pdf = sampleLights ? dot(diffDir, N) / M_PI : 0;
+                color += albedo * rayCastColor(Ray(diffPos, diffDir), depth + 1, sampler, pdf);
                 break;
             }
             case LIGHT: {
                 color = intersection.obj->evalDiffuseColor(st) * intersection.material->kd;
+                // A diffuse bounce that lands on a light shares this path with
+                // light sampling, so only its MIS share counts.
+                if (bsdfPdf > 0) {
+                    float pdf = lightPdf(intersection.obj, ray.origin, intersection.coords, intersection.normal);
+                    color = color * powerHeuristic(bsdfPdf, pdf);
+                }
                 break;
             }
         }
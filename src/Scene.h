@@ -1,44 +1,108 @@
 #pragma once
 
+#include <utility>
 #include <vector>
 
+#include "Arena.h"
 #include "BVH.h"
 #include "Object.h"
 #include "Ray.h"
+#include "Sampler.h"
 #include "Vector.h"
 #include "global.h"
 #include "Camera.h"
 
+// WHITTED follows every reflected and refracted ray recursively, so the work
+// inside glass doubles with each bounce. PATH follows a single path per sample
+// and picks the reflected or refracted branch by its Fresnel weight.
+enum class Integrator { WHITTED, PATH };
+
 class Scene {
    public:
     int width = 1280;
     int height = 960;
     Vec3 backgroundColor = Vec3(1.0);
     int maxDepth = 10;
+    // Connect every diffuse hit to a point sampled on a light (next-event
+    // estimation), combined with the BSDF bounce by multiple importance sampling.
+    bool directLighting = true;
+    Integrator integrator = Integrator::PATH;
+    // Paths longer than this many bounces survive Russian roulette with a
+    // probability given by their throughput.
+    int rouletteDepth = 3;
     bool bvhEnable;
+    BVHOptions bvhOptions;
     Camera camera;
 
     Scene() {}
     Scene(int w, int h, const Camera& cam, bool b) : width(w), height(h), camera(cam), bvhEnable(b) {}
     ~Scene();
 
+    // Takes ownership of a heap-allocated object.
     void Add(Object* object) {
         objects.push_back(object);
+        heapObjects.push_back(object);
+    }
+
+    // Constructs a T in the scene's arena and adds it. Worth it for scenes of
+    // many small objects (instances): they are allocated in a few blocks and
+    // freed together with the scene.
+    template <typename T, typename... Args>
+    T* Emplace(Args&&... args) {
+        T* object = objectArena.create<T>(std::forward<Args>(args)...);
+        objects.push_back(object);
+        return object;
     }
 
     const std::vector<Object *> &get_objects() const {
         return objects;
     }
     
+    // Two-level acceleration structure: the scene BVH is the top level, over
+    // objects, and every mesh keeps its own bottom-level BVH that instances
+    // share. buildBVH builds the top level and collects the lights.
     void buildBVH();
-    Vec3 rayCastColor(const Ray &ray, int depth) const;
+    // Brings the top level up to date after objects moved (Instance::setTransform).
+    // refit keeps the tree and recomputes its bounds bottom-up; otherwise the
+    // top level is rebuilt with bvhOptions. Bottom-level BVHs are not touched.
+    void updateBVH(bool refit);
+    // Radiance arriving along a camera ray, computed with the selected integrator.
+    Vec3 radiance(const Ray &ray, Sampler &sampler) const;
+    // The same, for a camera ray whose closest hit was already found (e.g. in
+    // a packet); primary.obj is NULL if it hit nothing.
+    Vec3 radiance(const Ray &ray, const Hit &primary, Sampler &sampler) const;
+    // Closest hit of ray, without its surface data (see Object::intersect).
+    bool intersect(const Ray &ray, Hit &hit) const;
+    // Closest hits of the rays of packet in the lane mask active, into the
+    // matching entries of hits.
+    void intersect(const RayPacket &packet, int active, Hit hits[]) const;
+    // bsdfPdf is the solid angle density the ray was sampled with at a diffuse
+    // bounce, or 0 if it was not (camera rays, specular bounces). primary, if
+    // given, is the ray's closest hit.
+    Vec3 rayCastColor(const Ray &ray, int depth, Sampler &sampler, float bsdfPdf = 0,
+                      const Hit *primary = NULL) const;
+    // Visibility test for shadow rays: true if any object blocks the ray
+    // before distance tMax.
+    bool occluded(const Ray &ray, float tMax) const;
     
 private:
+    Arena objectArena;
     std::vector<Object*> objects;
-    BVH *bvh;
+    // The objects given to Add; the others live in objectArena.
+    std::vector<Object*> heapObjects;
+    // Objects with a LIGHT material, collected by buildBVH.
+    std::vector<Object*> lights;
+    BVH *bvh = NULL;
     
     Intersection rayCast(const Ray &ray) const;
-    Intersection traverse(const Ray& ray) const;
+    // rayCast for a ray whose closest hit is primary, if that is given.
+    Intersection rayCast(const Ray &ray, const Hit *primary) const;
+    // Closest hit by testing every object, for scenes without a BVH.
+    bool traverse(const Ray& ray, Hit& hit) const;
+    Vec3 tracePath(const Ray &ray, Sampler &sampler, const Hit *primary = NULL) const;
+
+    Vec3 sampleLight(const Vec3 &P, const Vec3 &N, const Vec3 &albedo, Sampler &sampler) const;
+    float lightPdf(const Object *light, const Vec3 &P, const Vec3 &lightPos, const Vec3 &lightN) const;
 
     Vec3 reflect(const Vec3 &I, const Vec3 &N) const {
         return I - 2 * dot(I, N) * N;
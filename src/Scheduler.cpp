@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <thread>
+
+#include "Scheduler.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+TaskScheduler::TaskScheduler(int threadCount) {
+    if (threadCount <= 0)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < threadCount; i++)
+        queues.push_back(std::make_unique<WorkQueue>());
+    threadStats.resize(threadCount);
+}
+
+bool TaskScheduler::pop(int worker, int& task) {
+    WorkQueue& queue = *queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+        return false;
+    task = queue.tasks.front();
+    queue.tasks.pop_front();
+    return true;
+}
+
+bool TaskScheduler::steal(int thief, int& task) {
+    for (int i = 1; i < threadCount(); i++) {
+        WorkQueue& victim = *queues[(thief + i) % threadCount()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.tasks.empty())
+            continue;
+        task = victim.tasks.back();
+        victim.tasks.pop_back();
+        return true;
+    }
+    return false;
+}
+
+void TaskScheduler::run(int taskCount, const std::function<void(int)>& task,
+                        const std::function<void(float)>& progress) {
+    // Hand every worker one contiguous block, so neighbouring tasks (and the
+    // cache lines they touch) stay on the same thread until stealing kicks in.
+    int workers = threadCount();
+    for (int w = 0; w < workers; w++) {
+        int begin = static_cast<int>(static_cast<long long>(taskCount) * w / workers);
+        int end = static_cast<int>(static_cast<long long>(taskCount) * (w + 1) / workers);
+        queues[w]->tasks.clear();
+        for (int i = begin; i < end; i++)
+            queues[w]->tasks.push_back(i);
+        threadStats[w] = ThreadStats();
+    }
+
+    // Tasks never spawn tasks, so a worker that finds every deque empty is done.
+    std::atomic<int> finished(0);
+    Clock::time_point start = Clock::now();
+    std::vector<std::thread> threads;
+    for (int w = 0; w < workers; w++) {
+        threads.emplace_back([&, w]() {
+            ThreadStats& stats = threadStats[w];
+            int current;
+            while (true) {
+                bool stolen = false;
+                if (!pop(w, current)) {
+                    if (!steal(w, current))
+                        break;
+                    stolen = true;
+                }
+                Clock::time_point taskStart = Clock::now();
+                task(current);
+                stats.busySeconds += secondsSince(taskStart);
+                stats.tasks++;
+                stats.stolen += stolen;
+                finished++;
+            }
+        });
+    }
+    while (progress && finished < taskCount) {
+        progress(finished / (float)taskCount);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+    // A worker is idle whenever it is not running a task before the whole run ends.
+    double wallSeconds = secondsSince(start);
+    for (ThreadStats& stats : threadStats)
+        stats.idleSeconds = std::max(0.0, wallSeconds - stats.busySeconds);
+    if (progress)
+        progress(1.f);
+}
+
+void TaskScheduler::printStats(std::ostream& os) const {
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+    os << std::fixed << std::setprecision(3);
+    for (int w = 0; w < threadCount(); w++) {
+        const ThreadStats& stats = threadStats[w];
+        os << "thread " << std::setw(2) << w << ": busy " << stats.busySeconds << "s, idle "
+           << stats.idleSeconds << "s, " << stats.tasks << " tasks (" << stats.stolen
+           << " stolen)" << std::endl;
+    }
+    os.flags(flags);
+    os.precision(precision);
+}
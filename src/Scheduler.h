@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Work-stealing task scheduler. Every worker owns a deque of task indices,
+// pops work from its head and, once it runs dry, steals from the tail of the
+// other workers' deques, so uneven task costs do not leave threads idle.
+class TaskScheduler {
+public:
+    struct ThreadStats {
+        double busySeconds = 0;
+        double idleSeconds = 0;
+        int tasks = 0;
+        int stolen = 0;
+    };
+
+    // threadCount <= 0 uses std::thread::hardware_concurrency().
+    explicit TaskScheduler(int threadCount = 0);
+
+    int threadCount() const { return static_cast<int>(queues.size()); }
+
+    // Runs task(i) for every i in [0, taskCount) and blocks until all are done.
+    // The calling thread reports completion through progress about every 100 ms.
+    void run(int taskCount, const std::function<void(int)>& task,
+             const std::function<void(float)>& progress = nullptr);
+
+    // Busy/idle time per worker of the last run.
+    const std::vector<ThreadStats>& stats() const { return threadStats; }
+    void printStats(std::ostream& os) const;
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    bool pop(int worker, int& task);
+    bool steal(int thief, int& task);
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<ThreadStats> threadStats;
+};
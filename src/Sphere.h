@@ -25,35 +25,54 @@ class Sphere : public Object {
         material = NULL;
     }
     
-    Intersection rayCast(const Ray& ray) {
-        Intersection result;
-        result.happened = false;
+    bool intersect(const Ray& ray, Hit& hit) {
         Vec3 L = ray.origin - center;
         float a = dot(ray.direction, ray.direction);
         float b = 2 * dot(ray.direction, L);
         float c = dot(L, L) - radius2;
         float t0, t1;
         if (!solveQuadratic(a, b, c, t0, t1))
-            return result;
+            return false;
         if (t0 < 0)
             t0 = t1;
-        if (t0 < 0)
-            return result;
-        result.happened = true;
-        result.coords = Vec3(ray.origin + ray.direction * t0);
-        result.normal = normalize(Vec3(result.coords - center));
-        result.material = this->material;
-        result.obj = this;
-        result.distance = t0;
-        return result;
+        if (t0 < 0 || t0 >= hit.t)
+            return false;
+        hit.record(t0, 0, 0, this);
+        return true;
     }
     
-    void getSurfaceProperties(const Vec3 &P, const Vec3 &I,
-                              const Vec2 &uv, Vec3 &N, Vec2 &st) const {
+    bool occluded(const Ray& ray, float tMax) {
+        Vec3 L = ray.origin - center;
+        float a = dot(ray.direction, ray.direction);
+        float b = 2 * dot(ray.direction, L);
+        float c = dot(L, L) - radius2;
+        float t0, t1;
+        if (!solveQuadratic(a, b, c, t0, t1))
+            return false;
+        if (t0 < 0)
+            t0 = t1;
+        return t0 >= 0 && t0 < tMax;
+    }
+
+    void getSurfaceProperties(const Vec3 &P, const Vec3 &I, const Vec2 &uv,
+                              uint32_t primitive, Vec3 &N, Vec2 &st) const {
         N = normalize(P - center);
     }
 
     Vec3 evalDiffuseColor(const Vec2 &st) const {
         return material->getColor();
     }
+
+    float getArea() const {
+        return 4 * M_PI * radius2;
+    }
+
+    void sample(Sampler &sampler, Vec3 &position, Vec3 &normal, float &pdf) const {
+        float z = 1 - 2 * sampler.get1D();
+        float r = sqrtf(std::max(0.f, 1 - z * z));
+        float phi = 2 * M_PI * sampler.get1D();
+        normal = Vec3(r * cosf(phi), r * sinf(phi), z);
+        position = center + radius * normal;
+        pdf = 1 / getArea();
+    }
 };
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cmath>
+
+#include "Vector.h"
+#include "global.h"
+
+// Affine map p -> A p + b, stored as the three rows of the 3x4 matrix [A | b].
+class Transform {
+public:
+    float m[3][4];
+
+    Transform() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+    static Transform translate(const Vec3& t) {
+        Transform r;
+        r.m[0][3] = t.x;
+        r.m[1][3] = t.y;
+        r.m[2][3] = t.z;
+        return r;
+    }
+
+    static Transform scale(const Vec3& s) {
+        Transform r;
+        r.m[0][0] = s.x;
+        r.m[1][1] = s.y;
+        r.m[2][2] = s.z;
+        return r;
+    }
+
+    // Rotation by angle degrees around axis, counter-clockwise when looking
+    // down the axis towards the origin.
+    static Transform rotate(float angle, const Vec3& axis) {
+        Vec3 a = normalize(axis);
+        float c = cosf(deg2rad(angle)), s = sinf(deg2rad(angle)), t = 1 - c;
+        Transform r;
+        r.m[0][0] = t * a.x * a.x + c;
+        r.m[0][1] = t * a.x * a.y - s * a.z;
+        r.m[0][2] = t * a.x * a.z + s * a.y;
+        r.m[1][0] = t * a.x * a.y + s * a.z;
+        r.m[1][1] = t * a.y * a.y + c;
+        r.m[1][2] = t * a.y * a.z - s * a.x;
+        r.m[2][0] = t * a.x * a.z - s * a.y;
+        r.m[2][1] = t * a.y * a.z + s * a.x;
+        r.m[2][2] = t * a.z * a.z + c;
+        return r;
+    }
+
+    // Applies other first, then this.
+    Transform operator*(const Transform& other) const {
+        Transform r;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                r.m[i][j] = m[i][0] * other.m[0][j] + m[i][1] * other.m[1][j] + m[i][2] * other.m[2][j] +
+                            (j == 3 ? m[i][3] : 0);
+            }
+        }
+        return r;
+    }
+
+    float determinant() const {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+               m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    Transform inverse() const {
+        float invDet = 1 / determinant();
+        Transform r;
+        r.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * invDet;
+        r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+        r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+        r.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * invDet;
+        r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+        r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+        r.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * invDet;
+        r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+        r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+        Vec3 t = r.vector(Vec3(m[0][3], m[1][3], m[2][3]));
+        r.m[0][3] = -t.x;
+        r.m[1][3] = -t.y;
+        r.m[2][3] = -t.z;
+        return r;
+    }
+
+    Vec3 point(const Vec3& p) const {
+        return vector(p) + Vec3(m[0][3], m[1][3], m[2][3]);
+    }
+
+    // Directions ignore the translation.
+    Vec3 vector(const Vec3& v) const {
+        return Vec3(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                    m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                    m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    // Multiplies by the transpose of A. Normals go from object to world space
+    // through the transpose of the world-to-object transform.
+    Vec3 transposedVector(const Vec3& v) const {
+        return Vec3(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+                    m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+                    m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+    }
+};
@@ -1,29 +1,22 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <chrono>
 
 #include "BVH.h"
+#include "Buffer.h"
+#include "GeometryCache.h"
+#include "IndexedMesh.h"
+#include "IndexedTriangles.h"
 #include "Intersection.h"
 #include "Material.h"
 #include "OBJ_Loader.h"
+#include "ObjParser.h"
 #include "Object.h"
 #include "Triangle.h"
 
-// Möller Trumbore intersection algorithm
-bool rayTriangleIntersect(const Vec3& v0, const Vec3& e1, const Vec3& e2, const Vec3& orig,
-                          const Vec3& dir, float& tnear, float& u, float& v) {
-    Vec3 s0 = orig - v0;
-    Vec3 s1 = cross(dir, e2);
-    Vec3 s2 = cross(s0, e1);
-    // res: (tnear, u, v)
-    Vec3 res = (1 / dot(s1, e1)) * Vec3(dot(s2, e2), dot(s1, s0), dot(s2, dir));
-    tnear = res.x;
-    u = res.y;
-    v = res.z;
-    return res.x >= .0f && res.y >= .0f && res.z >= .0f && res.y + res.z <= 1.0f;
-}
-
 class Triangle : public Object {
    public:
     Vec3 v0, v1, v2;
@@ -41,25 +34,26 @@ class Triangle : public Object {
         bounding_box = merge(Bounds3(v0, v1), v2);
     }
 
-    Intersection rayCast(const Ray& ray) override {
-        Intersection inter;
+    bool intersect(const Ray& ray, Hit& hit) override {
         if (dot(ray.direction, normal) > 0)
-            return inter;
+            return false;
         float u, v, t = 0;
-        inter.happened = rayTriangleIntersect(v0, e1, e2, ray.origin, ray.direction, t, u, v);
-        if (inter.happened) {
-            inter.coords = ray.origin + t * ray.direction;
-            inter.normal = normal;
-            inter.uv = Vec2(u, v);
-            inter.obj = this;
-            inter.material = material;
-            inter.distance = t;
-        }
-        return inter;
+        if (!rayTriangleIntersect(v0, e1, e2, ray.origin, ray.direction, t, u, v) || t >= hit.t)
+            return false;
+        hit.record(t, u, v, this);
+        return true;
+    }
+
+    bool occluded(const Ray& ray, float tMax) override {
+        if (dot(ray.direction, normal) > 0)
+            return false;
+        float u, v, t = 0;
+        return rayTriangleIntersect(v0, e1, e2, ray.origin, ray.direction, t, u, v) && t < tMax;
     }
 
-    void getSurfaceProperties(const Vec3& P, const Vec3& I, const Vec2& uv,
+    void getSurfaceProperties(const Vec3& P, const Vec3& I, const Vec2& uv, uint32_t primitive,
                               Vec3& N, Vec2& st) const override {
+        N = normal;
         st = st0 * (1 - uv.x - uv.y) + st1 * uv.x + st2 * uv.y;
     };
 
@@ -69,76 +63,260 @@ class Triangle : public Object {
 //        bool v = (fmodf(st.x * scale, 1) > 0.5) ^ (fmodf(st.y * scale, 1) > 0.5);
 //        return v ? Vec3(1, 1, 0) : Vec3(1);
     }
+
+    float getArea() const override {
+        return 0.5f * cross(e1, e2).abs();
+    }
+
+    void sample(Sampler& sampler, Vec3& position, Vec3& N, float& pdf) const override {
+        float su = sqrtf(sampler.get1D());
+        float v = sampler.get1D();
+        position = v0 * (1 - su) + v1 * (su * (1 - v)) + v2 * (su * v);
+        N = normal;
+        pdf = 1 / getArea();
+    }
+};
+
+// How a MeshTriangle reads its file.
+struct MeshLoadOptions {
+    // Reader of OBJ files. All of them give the same mesh for a file of
+    // triangles; objl splits larger polygons its own way.
+    ObjLoader objLoader = ObjLoader::PARALLEL;
+    // Memory ceiling of the streaming reader in bytes, 0 for none.
+    size_t objMemoryLimit = 0;
+    // Directory of binary geometry caches (see GeometryCache); empty disables them.
+    std::string cacheDirectory;
 };
 
 class MeshTriangle : public Object {
    public:
-    MeshTriangle(const std::string& filename, Material* m, bool bvhEnable = true) : Object(m) {
-        objl::Loader loader;
-        loader.LoadFile(filename);
-
-        assert(loader.LoadedMeshes.size() == 1);
-        mesh = loader.LoadedMeshes[0];
-
-        Vec3 min_vert =
-            Vec3{std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(),
-                 std::numeric_limits<float>::infinity()};
-        Vec3 max_vert =
-            Vec3{-std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(),
-                 -std::numeric_limits<float>::infinity()};
-        
+    MeshTriangle(const std::string& filename, Material* m, bool bvhEnable = true,
+                 const BVHOptions& bvhOptions = BVHOptions(), const MeshLoadOptions& loadOptions = MeshLoadOptions())
+        : Object(m) {
+        // The reported peak is the rise of the high-water mark, which shows
+        // this load's own peak if the caller lowered it (resetPeakMemory).
+        size_t residentBefore, peakBefore;
+        memoryUsage(residentBefore, peakBefore);
         material->specularExp = 8;
-        for (int i = 0; i < mesh.vertices.size(); i += 3) {
-            for (int j = 0; j < 3; j++) {
-                auto vert = Vec3(mesh.vertices[i + j].position.x, mesh.vertices[i + j].position.y,
-                                mesh.vertices[i + j].position.z);
-                min_vert = Vec3(std::min(min_vert.x, mesh.vertices[i + j].position.x), std::min(min_vert.y, mesh.vertices[i + j].position.y),
-                                std::min(min_vert.z, mesh.vertices[i + j].position.z));
-                max_vert = Vec3(std::max(max_vert.x, mesh.vertices[i + j].position.x), std::max(max_vert.y, mesh.vertices[i + j].position.y),
-                                std::max(max_vert.z, mesh.vertices[i + j].position.z));
+        auto loadStart = std::chrono::steady_clock::now();
+        // The streaming reader's own estimate of its peak, 0 for the others.
+        size_t loaderBytes = 0;
+        // The cache holds flattened trees only.
+        std::string cachePath;
+        uint64_t cacheKey = 0;
+        if (!loadOptions.cacheDirectory.empty() && (!bvhEnable || bvhOptions.layout != BVHLayout::POINTER))
+            cacheKey = GeometryCache::key(filename, loadOptions.objLoader, bvhEnable, bvhOptions);
+        if (cacheKey != 0) {
+            cachePath = GeometryCache::path(loadOptions.cacheDirectory, filename, cacheKey);
+            cache = std::make_unique<GeometryCache>();
+            if (!cache->open(cachePath, cacheKey))
+                cache.reset();
+        }
+        if (cache != NULL) {
+            loadCache(bvhEnable, bvhOptions);
+        } else {
+            // A mesh that failed to load has nothing to build or cache.
+            if (!loadFile(filename, loadOptions, loaderBytes) || numTriangles == 0) {
+                std::cerr << "Cannot load " << filename << std::endl;
+            } else {
+                if (bvhEnable)
+                    buildBVH(bvhOptions);
+                if (!cachePath.empty() && !writeCache(cachePath, cacheKey))
+                    std::cerr << "Cannot write geometry cache " << cachePath << std::endl;
             }
-            triangles.push_back(new Triangle(mesh.vertices[i], mesh.vertices[i+1], mesh.vertices[i+2], material));
         }
-        bounding_box = Bounds3(min_vert, max_vert);
-        if (bvhEnable)
-            bvh = new BVH(triangles);
+        double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+        size_t resident, peak;
+        memoryUsage(resident, peak);
+        std::cout << filename << ": " << numTriangles << " triangles, " << numVertices << " vertices, loaded "
+                  << (cache != NULL ? "from cache " : "") << "in " << loadMs << " ms";
+        if (bvh != NULL)
+            std::cout << ", BVH " << bvh->nodeCount() << " nodes, SAH cost " << bvh->sahCost();
+        // Resident memory can shrink while loading, when freed buffers go back to the system.
+        auto changeKB = [](size_t after, size_t before) { return ((long long)after - (long long)before) / 1024; };
+        std::cout << ", " << memoryBytes() / 1024 << " KB (resident " << std::showpos
+                  << changeKB(resident, residentBefore) << " KB, peak " << changeKB(peak, peakBefore)
+                  << std::noshowpos << " KB";
+        if (loaderBytes > 0)
+            std::cout << ", streaming loader estimate " << loaderBytes / 1024 << " KB";
+        std::cout << ")" << std::endl;
     }
     
     ~MeshTriangle() {
-        for (Object* t : triangles) {
-            delete t;
-        }
-        triangles.clear();
+        delete bvh;
     }
 
-    void getSurfaceProperties(const Vec3& P, const Vec3& I, const Vec2& uv,
-                              Vec3& N, Vec2& st) const {
+    // False if the file could not be read or holds no triangles.
+    bool loaded() const {
+        return numTriangles > 0;
     }
 
-    Vec3 evalDiffuseColor(const Vec2& st) const {
-        return Vec3(0.5, 0.5, 0.5);
+    // primitive is the triangle that was hit.
+    void getSurfaceProperties(const Vec3& P, const Vec3& I, const Vec2& uv, uint32_t primitive,
+                              Vec3& N, Vec2& st) const override {
+        Vec3 v0, v1, v2;
+        triangles.corners(primitive, v0, v1, v2);
+        N = normalize(cross(v1 - v0, v2 - v0));
+        const uint32_t* corner = &vertexIndex[primitive * 3];
+        st = stCoordinates[corner[0]] * (1 - uv.x - uv.y) + stCoordinates[corner[1]] * uv.x +
+             stCoordinates[corner[2]] * uv.y;
     }
 
-    Intersection rayCast(const Ray& ray) {
-        Intersection intersection;
-        if (bvh != NULL) {
-            intersection = bvh->rayCast(ray);
+    Vec3 evalDiffuseColor(const Vec2& st) const override {
+        return material->getColor();
+    }
+
+    float getArea() const override {
+        return area;
+    }
+
+    // Picks a triangle in proportion to its area, so points are uniform over the mesh.
+    void sample(Sampler& sampler, Vec3& position, Vec3& normal, float& pdf) const override {
+        float target = sampler.get1D() * area;
+        size_t idx = std::upper_bound(areaCdf.begin(), areaCdf.end(), target) - areaCdf.begin();
+        idx = std::min(idx, areaCdf.size() - 1);
+        Vec3 v0, v1, v2;
+        triangles.corners(idx, v0, v1, v2);
+        float su = sqrtf(sampler.get1D());
+        float v = sampler.get1D();
+        position = v0 * (1 - su) + v1 * (su * (1 - v)) + v2 * (su * v);
+        normal = normalize(cross(v1 - v0, v2 - v0));
+        pdf = 1 / area;
+    }
+
+    // Hits are recorded against the mesh, with the triangle as their primitive.
+    bool intersect(const Ray& ray, Hit& hit) override {
+        if (bvh != NULL)
+            return bvh->intersect(ray, hit);
+        bool found = false;
+        for (uint32_t i = 0; i < numTriangles; i++)
+            found |= triangles.intersect(i, ray, hit);
+        return found;
+    }
+    int intersect(const RayPacket& packet, int active, Hit hits[]) override {
+        if (bvh != NULL)
+            return bvh->intersect(packet, active, hits);
+        return Object::intersect(packet, active, hits);
+    }
+    bool occluded(const Ray& ray, float tMax) override {
+        if (bvh != NULL)
+            return bvh->occluded(ray, tMax);
+        for (uint32_t i = 0; i < numTriangles; i++) {
+            if (triangles.occluded(i, ray, tMax))
+                return true;
+        }
+        return false;
+    }
+
+    // Bytes held by the mesh: vertex and index buffers, the area table and the BVH.
+    size_t memoryBytes() const {
+        size_t bytes = numVertices * (sizeof(Vec3) + sizeof(Vec2)) + numTriangles * 3 * sizeof(uint32_t) +
+                       areaCdf.capacity() * sizeof(float);
+        return bvh != NULL ? bytes + bvh->memoryBytes() : bytes;
+    }
+
+private:
+    // False if the file cannot be read; the mesh is then left empty.
+    // loaderBytes receives the streaming reader's peak estimate.
+    bool loadFile(const std::string& filename, const MeshLoadOptions& options, size_t& loaderBytes) {
+        IndexedMesh mesh;
+        if (options.objLoader == ObjLoader::PARALLEL) {
+            if (!loadObj(filename, mesh))
+                return false;
+        } else if (options.objLoader == ObjLoader::STREAMING) {
+            if (!loadObjStreaming(filename, mesh, options.objMemoryLimit, loaderBytes))
+                return false;
         } else {
-            for (Object* object : triangles) {
-                Intersection tmp = object->rayCast(ray);
-                if (tmp.distance < intersection.distance) {
-                    intersection = tmp;
-                }
+            objl::Loader loader;
+            if (!loader.LoadFile(filename))
+                return false;
+            // objl keeps every corner of a face as a vertex and triangulates
+            // through its index list.
+            IndexedMeshBuilder builder(mesh);
+            for (const Mesh& objMesh : loader.LoadedMeshes) {
+                for (unsigned int index : objMesh.indices)
+                    builder.addCorner(objMesh.vertices[index].position, objMesh.vertices[index].texCoord);
             }
         }
-        return intersection;
+        setGeometry(std::move(mesh.positions), std::move(mesh.stCoordinates), std::move(mesh.indices));
+        return true;
     }
-private:
-    std::unique_ptr<Vec3[]> vertices;
-    uint32_t numTriangles;
-    std::unique_ptr<uint32_t[]> vertexIndex;
-    std::unique_ptr<Vec2[]> stCoordinates;
-    std::vector<Object*> triangles;
+
+    void buildBVH(const BVHOptions& bvhOptions) {
+        bvh = new BVH(triangles, bvhOptions);
+        if (bvhOptions.packTriangles)
+            bvh->packTriangles();
+    }
+
+    // Buffers and tree are views into the mapped cache; only the area table
+    // is rebuilt.
+    void loadCache(bool bvhEnable, const BVHOptions& bvhOptions) {
+        setGeometry(cache->view<Vec3>(GeometryCache::POSITIONS), cache->view<Vec2>(GeometryCache::ST_COORDINATES),
+                    cache->view<uint32_t>(GeometryCache::INDICES));
+        if (!bvhEnable)
+            return;
+        bvh = new BVH(triangles, bvhOptions, cache->view<uint32_t>(GeometryCache::PRIMITIVE_ORDER),
+                      cache->view<BVH::LinearBVHNode>(GeometryCache::LINEAR_NODES),
+                      cache->view<BVH::WideBVHNode>(GeometryCache::WIDE_NODES),
+                      cache->view<TrianglePacket>(GeometryCache::TRIANGLE_PACKETS),
+                      cache->view<uint32_t>(GeometryCache::LEAF_PACKETS));
+    }
+
+    bool writeCache(const std::string& path, uint64_t key) const {
+        GeometryCache::SectionData sections[GeometryCache::SECTION_COUNT];
+        sections[GeometryCache::POSITIONS] = GeometryCache::section(vertices.data(), numVertices);
+        sections[GeometryCache::ST_COORDINATES] = GeometryCache::section(stCoordinates.data(), numVertices);
+        sections[GeometryCache::INDICES] = GeometryCache::section(vertexIndex.data(), numTriangles * 3);
+        if (bvh != NULL) {
+            sections[GeometryCache::PRIMITIVE_ORDER] =
+                GeometryCache::section(bvh->orderedPrimitives().data(), bvh->orderedPrimitives().size());
+            sections[GeometryCache::LINEAR_NODES] =
+                GeometryCache::section(bvh->linearNodes().data(), bvh->linearNodes().size());
+            sections[GeometryCache::WIDE_NODES] = GeometryCache::section(bvh->wideNodes().data(), bvh->wideNodes().size());
+            sections[GeometryCache::TRIANGLE_PACKETS] =
+                GeometryCache::section(bvh->trianglePackets().data(), bvh->trianglePackets().size());
+            sections[GeometryCache::LEAF_PACKETS] =
+                GeometryCache::section(bvh->leafPacketOffsets().data(), bvh->leafPacketOffsets().size());
+        }
+        return GeometryCache::write(path, key, sections);
+    }
+
+    void setGeometry(Buffer<Vec3>&& positions, Buffer<Vec2>&& st, Buffer<uint32_t>&& indices) {
+        numTriangles = indices.size() / 3;
+        numVertices = positions.size();
+        vertices = std::move(positions);
+        stCoordinates = std::move(st);
+        vertexIndex = std::move(indices);
+
+        Bounds3 bounds;
+        for (uint32_t i = 0; i < numVertices; i++)
+            bounds = merge(bounds, vertices[i]);
+        bounding_box = bounds;
+
+        triangles = {vertices.data(), vertexIndex.data(), numTriangles, this};
+        areaCdf.reserve(numTriangles);
+        for (uint32_t i = 0; i < numTriangles; i++) {
+            Vec3 v0, v1, v2;
+            triangles.corners(i, v0, v1, v2);
+            area += 0.5f * cross(v1 - v0, v2 - v0).abs();
+            areaCdf.push_back(area);
+        }
+    }
+
+    // Mapped cache file the buffers below may view; declared first so it
+    // outlives them.
+    std::unique_ptr<GeometryCache> cache;
+    Buffer<Vec3> vertices;
+    uint32_t numVertices = 0;
+    uint32_t numTriangles = 0;
+    // Three vertex indices per triangle.
+    Buffer<uint32_t> vertexIndex;
+    // Texture coordinate of each vertex.
+    Buffer<Vec2> stCoordinates;
+    // The triangles as seen by the BVH, over the buffers above.
+    IndexedTriangles triangles;
+    // Running sum of triangle areas, for sampling points on the mesh.
+    std::vector<float> areaCdf;
+    float area = 0;
     BVH* bvh = NULL;
-    Mesh mesh;
 };
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+
+#include "Ray.h"
+#include "RayPacket.h"
+#include "Vector.h"
+
+// Four triangles in structure-of-arrays form, so one Möller Trumbore test
+// runs on all of them at once. Unused lanes have zero edges and never hit.
+struct alignas(16) TrianglePacket {
+    float v0[3][4];
+    float e1[3][4];
+    float e2[3][4];
+    // Index of each lane's triangle in the BVH's primitive order.
+    uint32_t primitive[4];
+};
+
+// The ray broadcast to every lane of a packet test.
+struct PacketRay {
+    Vec4 origin[3];
+    Vec4 direction[3];
+
+    PacketRay(const Ray& ray) {
+        for (int axis = 0; axis < 3; axis++) {
+            origin[axis] = Vec4(ray.origin[axis]);
+            direction[axis] = Vec4(ray.direction[axis]);
+        }
+    }
+};
+
+// Möller Trumbore on four (ray, triangle) pairs, one per lane, culling back
+// faces like Triangle::intersect. Returns a mask of the lanes hit at a
+// distance below tMax and stores (tnear, u, v) of every lane.
+inline int rayTriangleIntersect(const Vec4 v0[3], const Vec4 e1[3], const Vec4 e2[3], const Vec4 orig[3],
+                                const Vec4 dir[3], const Vec4& tMax, Vec4& tnear, Vec4& u, Vec4& v) {
+    Vec4 s0[3] = {orig[0] - v0[0], orig[1] - v0[1], orig[2] - v0[2]};
+    Vec4 s1[3] = {dir[1] * e2[2] - dir[2] * e2[1], dir[2] * e2[0] - dir[0] * e2[2], dir[0] * e2[1] - dir[1] * e2[0]};
+    Vec4 s2[3] = {s0[1] * e1[2] - s0[2] * e1[1], s0[2] * e1[0] - s0[0] * e1[2], s0[0] * e1[1] - s0[1] * e1[0]};
+    auto dot = [](const Vec4* a, const Vec4* b) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; };
+    Vec4 det = dot(s1, e1);
+    Vec4 invDet = Vec4(1.f) / det;
+    tnear = invDet * dot(s2, e2);
+    u = invDet * dot(s1, s0);
+    v = invDet * dot(s2, dir);
+    Vec4 zero(0.f);
+    // A negative determinant is a back face; zero is a degenerate or unused lane.
+    return Vec4::less(zero, det) & Vec4::lessEqual(zero, tnear) & Vec4::less(tnear, tMax) &
+           Vec4::lessEqual(zero, u) & Vec4::lessEqual(zero, v) & Vec4::lessEqual(u + v, Vec4(1.f));
+}
+
+// One ray against the four triangles of a packet.
+inline int rayTriangleIntersect(const TrianglePacket& packet, const PacketRay& ray, float tMax,
+                                Vec4& tnear, Vec4& u, Vec4& v) {
+    Vec4 v0[3], e1[3], e2[3];
+    for (int axis = 0; axis < 3; axis++) {
+        v0[axis] = Vec4::load(packet.v0[axis]);
+        e1[axis] = Vec4::load(packet.e1[axis]);
+        e2[axis] = Vec4::load(packet.e2[axis]);
+    }
+    return rayTriangleIntersect(v0, e1, e2, ray.origin, ray.direction, Vec4(tMax), tnear, u, v);
+}
+
+// Four rays, the lanes of a RayPacket starting at first, against the
+// triangle in lane of a packet. Gives exactly the distances and barycentrics
+// the single-ray test above finds for each of the rays.
+inline int rayTriangleIntersect(const TrianglePacket& packet, int lane, const RayPacket& rays, int first,
+                                const Vec4& tMax, Vec4& tnear, Vec4& u, Vec4& v) {
+    Vec4 v0[3], e1[3], e2[3], orig[3], dir[3];
+    for (int axis = 0; axis < 3; axis++) {
+        v0[axis] = Vec4(packet.v0[axis][lane]);
+        e1[axis] = Vec4(packet.e1[axis][lane]);
+        e2[axis] = Vec4(packet.e2[axis][lane]);
+        orig[axis] = Vec4::load(&rays.origin[axis][first]);
+        dir[axis] = Vec4::load(&rays.direction[axis][first]);
+    }
+    return rayTriangleIntersect(v0, e1, e2, orig, dir, tMax, tnear, u, v);
+}
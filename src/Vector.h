@@ -4,6 +4,102 @@
 #include <cmath>
 #include <iostream>
 
+// RT_SIMD_SSE or RT_SIMD_AVX (set by the RT_SIMD CMake option) back Vec3 and
+// Vec4 with SSE4.1 registers; without either they are plain floats.
+#if defined(RT_SIMD_AVX) && !defined(RT_SIMD_SSE)
+#define RT_SIMD_SSE
+#endif
+
+#ifdef RT_SIMD_SSE
+#include <immintrin.h>
+#endif
+
+#ifdef RT_SIMD_SSE
+// x, y, z share a register with an unused fourth lane w. w is not kept at any
+// particular value, so everything that reduces over lanes looks at three.
+class alignas(16) Vec3 {
+public:
+    union {
+        struct {
+            float x, y, z, w;
+        };
+        __m128 m;
+    };
+
+    Vec3(__m128 v) : m(v) {}
+
+    Vec3(float vx, float vy, float vz) : m(_mm_setr_ps(vx, vy, vz, 0)) {}
+
+    Vec3(float v) : Vec3(v, v, v) {}
+
+    Vec3() : m(_mm_setzero_ps()) {}
+
+    // Reads four floats; the fourth is ignored.
+    static Vec3 load(const float *p) {
+        return _mm_loadu_ps(p);
+    }
+
+    Vec3 operator*(const float &r) const {
+        return _mm_mul_ps(m, _mm_set1_ps(r));
+    }
+
+    Vec3 operator/(const float &r) const {
+        return _mm_div_ps(m, _mm_set1_ps(r));
+    }
+
+    Vec3 operator*(const Vec3 &v) const {
+        return _mm_mul_ps(m, v.m);
+    }
+
+    Vec3 operator-(const Vec3 &v) const {
+        return _mm_sub_ps(m, v.m);
+    }
+
+    Vec3 operator+(const Vec3 &v) const {
+        return _mm_add_ps(m, v.m);
+    }
+
+    Vec3 operator-() const {
+        return _mm_xor_ps(m, _mm_set1_ps(-0.f));
+    }
+
+    Vec3 &operator+=(const Vec3 &v) {
+        m = _mm_add_ps(m, v.m);
+        return *this;
+    }
+
+    bool operator==(const Vec3 &other) const {
+        return (_mm_movemask_ps(_mm_cmpeq_ps(m, other.m)) & 7) == 7;
+    }
+
+    bool operator!=(const Vec3 &other) const {
+        return !(*this == other);
+    }
+
+    float abs() const {
+        return _mm_cvtss_f32(_mm_sqrt_ss(_mm_dp_ps(m, m, 0x71)));
+    }
+
+    float minComponent() const {
+        __m128 yz = _mm_min_ss(_mm_shuffle_ps(m, m, _MM_SHUFFLE(3, 3, 3, 1)),
+                               _mm_shuffle_ps(m, m, _MM_SHUFFLE(3, 3, 3, 2)));
+        return _mm_cvtss_f32(_mm_min_ss(m, yz));
+    }
+
+    float maxComponent() const {
+        __m128 yz = _mm_max_ss(_mm_shuffle_ps(m, m, _MM_SHUFFLE(3, 3, 3, 1)),
+                               _mm_shuffle_ps(m, m, _MM_SHUFFLE(3, 3, 3, 2)));
+        return _mm_cvtss_f32(_mm_max_ss(m, yz));
+    }
+
+    static Vec3 min(const Vec3 &p1, const Vec3 &p2) {
+        return _mm_min_ps(p1.m, p2.m);
+    }
+
+    static Vec3 max(const Vec3 &p1, const Vec3 &p2) {
+        return _mm_max_ps(p1.m, p2.m);
+    }
+#else
 class Vec3 {
 public:
     float x, y, z;
@@ -13,6 +109,10 @@ public:
     Vec3(float v) : Vec3(v, v, v) {}
     
     Vec3() : Vec3(0) {}
+
+    static Vec3 load(const float *p) {
+        return Vec3(p[0], p[1], p[2]);
+    }
     
     Vec3 operator*(const float &r) const {
         return Vec3(x * r, y * r, z * r);
@@ -50,20 +150,19 @@ public:
     }
     
     bool operator!=(const Vec3& other) const {
-        return x != other.x || y == other.y || z == other.z;
+        return !(*this == other);
     }
     
     float abs() const {
         return sqrtf(x * x + y * y + z * z);
     }
-    
-    friend Vec3 operator*(const float &r, const Vec3 &v) {
-        return v * r;
+
+    float minComponent() const {
+        return std::min(x, std::min(y, z));
     }
-    
-    float operator[](int index) const {
-        assert(index >= 0 && index <= 2);
-        return (&x)[index];
+
+    float maxComponent() const {
+        return std::max(x, std::max(y, z));
     }
     
     static Vec3 min(const Vec3 &p1, const Vec3 &p2) {
@@ -73,17 +172,34 @@ public:
     static Vec3 max(const Vec3 &p1, const Vec3 &p2) {
         return Vec3(std::max(p1.x, p2.x), std::max(p1.y, p2.y), std::max(p1.z, p2.z));
     }
+#endif
+    
+    friend Vec3 operator*(const float &r, const Vec3 &v) {
+        return v * r;
+    }
+    
+    // Unchecked: this sits in the slab and SAH loops.
+    float operator[](int index) const {
+        return (&x)[index];
+    }
 };
 
 inline Vec3 lerp(const Vec3 &a, const Vec3 &b, const float &t) {
     return a * (1 - t) + b * t;
 }
 
-inline Vec3 normalize(const Vec3 &v) {
-    float invAbs = 1 / v.abs();
-    return Vec3(v.x * invAbs, v.y * invAbs, v.z * invAbs);
+#ifdef RT_SIMD_SSE
+inline float dot(const Vec3 &a, const Vec3 &b) {
+    return _mm_cvtss_f32(_mm_dp_ps(a.m, b.m, 0x71));
 }
 
+inline Vec3 cross(const Vec3 &a, const Vec3 &b) {
+    __m128 a_yzx = _mm_shuffle_ps(a.m, a.m, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_yzx = _mm_shuffle_ps(b.m, b.m, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a.m, b_yzx), _mm_mul_ps(a_yzx, b.m));
+    return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+}
+#else
 inline float dot(const Vec3 &a, const Vec3 &b) {
     return a.x * b.x + a.y * b.y + a.z * b.z;
 }
@@ -91,6 +207,132 @@ inline float dot(const Vec3 &a, const Vec3 &b) {
 inline Vec3 cross(const Vec3 &a, const Vec3 &b) {
     return Vec3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
 }
+#endif
+
+inline Vec3 normalize(const Vec3 &v) {
+    float invAbs = 1 / v.abs();
+    return v * invAbs;
+}
+
+// Four independent float lanes, e.g. one coordinate of four boxes or four
+// triangles tested against the same ray.
+class alignas(16) Vec4 {
+public:
+#ifdef RT_SIMD_SSE
+    __m128 m;
+
+    Vec4(__m128 v) : m(v) {}
+
+    Vec4(float a, float b, float c, float d) : m(_mm_setr_ps(a, b, c, d)) {}
+
+    Vec4(float v) : m(_mm_set1_ps(v)) {}
+
+    // p must be 16-byte aligned.
+    static Vec4 load(const float *p) {
+        return _mm_load_ps(p);
+    }
+
+    void store(float *p) const {
+        _mm_store_ps(p, m);
+    }
+
+    Vec4 operator+(const Vec4 &v) const {
+        return _mm_add_ps(m, v.m);
+    }
+
+    Vec4 operator-(const Vec4 &v) const {
+        return _mm_sub_ps(m, v.m);
+    }
+
+    Vec4 operator*(const Vec4 &v) const {
+        return _mm_mul_ps(m, v.m);
+    }
+
+    Vec4 operator/(const Vec4 &v) const {
+        return _mm_div_ps(m, v.m);
+    }
+
+    float operator[](int index) const {
+        alignas(16) float v[4];
+        store(v);
+        return v[index];
+    }
+
+    static Vec4 min(const Vec4 &a, const Vec4 &b) {
+        return _mm_min_ps(a.m, b.m);
+    }
+
+    static Vec4 max(const Vec4 &a, const Vec4 &b) {
+        return _mm_max_ps(a.m, b.m);
+    }
+
+    // Bit i is set when a[i] < b[i].
+    static int less(const Vec4 &a, const Vec4 &b) {
+        return _mm_movemask_ps(_mm_cmplt_ps(a.m, b.m));
+    }
+
+    // Bit i is set when a[i] <= b[i].
+    static int lessEqual(const Vec4 &a, const Vec4 &b) {
+        return _mm_movemask_ps(_mm_cmple_ps(a.m, b.m));
+    }
+#else
+    float v[4];
+
+    Vec4(float a, float b, float c, float d) : v{a, b, c, d} {}
+
+    Vec4(float s) : Vec4(s, s, s, s) {}
+
+    static Vec4 load(const float *p) {
+        return Vec4(p[0], p[1], p[2], p[3]);
+    }
+
+    void store(float *p) const {
+        std::copy(v, v + 4, p);
+    }
+
+    Vec4 operator+(const Vec4 &o) const {
+        return Vec4(v[0] + o.v[0], v[1] + o.v[1], v[2] + o.v[2], v[3] + o.v[3]);
+    }
+
+    Vec4 operator-(const Vec4 &o) const {
+        return Vec4(v[0] - o.v[0], v[1] - o.v[1], v[2] - o.v[2], v[3] - o.v[3]);
+    }
+
+    Vec4 operator*(const Vec4 &o) const {
+        return Vec4(v[0] * o.v[0], v[1] * o.v[1], v[2] * o.v[2], v[3] * o.v[3]);
+    }
+
+    Vec4 operator/(const Vec4 &o) const {
+        return Vec4(v[0] / o.v[0], v[1] / o.v[1], v[2] / o.v[2], v[3] / o.v[3]);
+    }
+
+    float operator[](int index) const {
+        return v[index];
+    }
+
+    static Vec4 min(const Vec4 &a, const Vec4 &b) {
+        return Vec4(std::min(a.v[0], b.v[0]), std::min(a.v[1], b.v[1]),
+                    std::min(a.v[2], b.v[2]), std::min(a.v[3], b.v[3]));
+    }
+
+    static Vec4 max(const Vec4 &a, const Vec4 &b) {
+        return Vec4(std::max(a.v[0], b.v[0]), std::max(a.v[1], b.v[1]),
+                    std::max(a.v[2], b.v[2]), std::max(a.v[3], b.v[3]));
+    }
+
+    static int less(const Vec4 &a, const Vec4 &b) {
+        return (a.v[0] < b.v[0]) | (a.v[1] < b.v[1]) << 1 |
+               (a.v[2] < b.v[2]) << 2 | (a.v[3] < b.v[3]) << 3;
+    }
+
+    static int lessEqual(const Vec4 &a, const Vec4 &b) {
+        return (a.v[0] <= b.v[0]) | (a.v[1] <= b.v[1]) << 1 |
+               (a.v[2] <= b.v[2]) << 2 | (a.v[3] <= b.v[3]) << 3;
+    }
+#endif
+
+    Vec4() : Vec4(0.f) {}
+};
 
 class Vec2 {
 public:
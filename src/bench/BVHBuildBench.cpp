@@ -0,0 +1,146 @@
+// Measures BVH construction and teardown time as the scene grows, by
+// building over models/cyborg.obj replicated side by side, and counts the
+// heap allocations each makes. Triangles and pointer-tree nodes come from
+// arenas, so both counts stay far below the number of objects.
+//
+// Usage: BVHBuildBench [model.obj] [copies...]   (default copies: 10 20 50 100)
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "Arena.h"
+#include "BVH.h"
+#include "Triangle.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Every operator new of the process, so a phase's allocations are the
+// difference of two readings.
+static std::atomic<size_t> heapAllocations{0};
+
+void* operator new(size_t size) {
+    heapAllocations++;
+    if (void* p = malloc(size != 0 ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+    free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+static const char* splitNames[] = {"median", "sah   ", "lbvh  "};
+
+static double millisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    std::string filename = argc > 1 ? argv[1] : "models/cyborg.obj";
+    std::vector<int> copyCounts;
+    for (int i = 2; i < argc; i++)
+        copyCounts.push_back(atoi(argv[i]));
+    if (copyCounts.empty())
+        copyCounts = {10, 20, 50, 100};
+
+    objl::Loader loader;
+    if (!loader.LoadFile(filename) || loader.LoadedMeshes.empty()) {
+        std::cerr << "Failed to load " << filename << std::endl;
+        return 1;
+    }
+    // objl keeps every corner of a face as a vertex and lists its triangles by index.
+    std::vector<Vertex> corners;
+    for (const Mesh& mesh : loader.LoadedMeshes) {
+        for (unsigned int index : mesh.indices)
+            corners.push_back(mesh.vertices[index]);
+    }
+    Bounds3 meshBounds;
+    for (const Vertex& v : corners)
+        meshBounds = merge(meshBounds, v.position);
+    Vec3 extent = meshBounds.pMax - meshBounds.pMin;
+
+    Material material;
+    std::cout << std::fixed << std::setprecision(2);
+    for (int copies : copyCounts) {
+        // Lay the copies out on a square grid in the xz plane.
+        int side = std::ceil(std::sqrt(copies));
+        Arena arena;
+        std::vector<Object*> triangles;
+        triangles.reserve(copies * (corners.size() / 3));
+        size_t allocations = heapAllocations;
+        Clock::time_point start = Clock::now();
+        for (int c = 0; c < copies; c++) {
+            Vec3 shift((c % side) * extent.x * 1.1f, 0, (c / side) * extent.z * 1.1f);
+            for (size_t i = 0; i + 2 < corners.size(); i += 3) {
+                Vertex v[3] = {corners[i], corners[i + 1], corners[i + 2]};
+                for (Vertex& vertex : v)
+                    vertex.position = vertex.position + shift;
+                triangles.push_back(arena.create<Triangle>(v[0], v[1], v[2], &material));
+            }
+        }
+        std::cout << std::setw(4) << copies << " copies, " << std::setw(8) << triangles.size()
+                  << " triangles: create " << millisecondsSince(start) << " ms, "
+                  << heapAllocations - allocations << " allocations" << std::endl;
+
+        for (BVHSplitMethod split : {BVHSplitMethod::MEDIAN, BVHSplitMethod::SAH, BVHSplitMethod::LBVH}) {
+            BVH* serial = NULL;
+            // Use at least two threads so the forking paths run even on one core.
+            int parallelThreads = std::max(2u, std::thread::hardware_concurrency());
+            for (int threads : {1, parallelThreads}) {
+                BVHOptions options;
+                options.splitMethod = split;
+                options.buildThreads = threads;
+                size_t allocations = heapAllocations;
+                Clock::time_point start = Clock::now();
+                BVH* bvh = new BVH(triangles, options);
+                double buildMs = millisecondsSince(start);
+                allocations = heapAllocations - allocations;
+                std::cout << "      " << splitNames[int(split)] << (threads == 1 ? " serial  " : " parallel")
+                          << ": build " << std::setw(9) << buildMs << " ms, " << std::setw(6) << allocations
+                          << " allocations, " << bvh->nodeCount() << " nodes, SAH cost " << bvh->sahCost();
+                if (serial == NULL) {
+                    serial = bvh;
+                } else {
+                    // The parallel builder must reproduce the serial tree exactly.
+                    bool same = std::equal(bvh->orderedPrimitives().begin(), bvh->orderedPrimitives().end(),
+                                           serial->orderedPrimitives().begin(), serial->orderedPrimitives().end()) &&
+                                bvh->linearNodes().size() == serial->linearNodes().size() &&
+                                std::memcmp(bvh->linearNodes().data(), serial->linearNodes().data(),
+                                            bvh->linearNodes().size() * sizeof(BVH::LinearBVHNode)) == 0;
+                    std::cout << (same ? ", same tree" : ", TREE DIFFERS");
+                    delete bvh;
+                }
+                std::cout << std::endl;
+            }
+            delete serial;
+
+            // The pointer layout keeps the node tree, so its teardown frees it.
+            BVHOptions options;
+            options.splitMethod = split;
+            options.layout = BVHLayout::POINTER;
+            size_t allocations = heapAllocations;
+            start = Clock::now();
+            BVH* bvh = new BVH(triangles, options);
+            double buildMs = millisecondsSince(start);
+            allocations = heapAllocations - allocations;
+            size_t blocks = bvh->nodeArenaBlocks();
+            start = Clock::now();
+            delete bvh;
+            std::cout << "      " << splitNames[int(split)] << " pointer : build " << std::setw(9) << buildMs
+                      << " ms, " << std::setw(6) << allocations << " allocations (" << blocks
+                      << " node blocks), teardown " << millisecondsSince(start) << " ms" << std::endl;
+        }
+        start = Clock::now();
+        arena.reset();
+        std::cout << "      triangles freed in " << millisecondsSince(start) << " ms" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,165 @@
+// Compares ray throughput of the BVH layouts, with and without packed leaf
+// triangles, on one model, with random rays
+// shot from a sphere around it towards points inside its bounds. Closest hits
+// are also traced as RayPackets of 8, for those random rays and for the
+// coherent rays of a pinhole camera looking at the model in 4x2 pixel blocks.
+//
+// Usage: BVHTraceBench [model.obj] [rays] [packet fallback rays]
+//        (default models/cyborg.obj, 1000000 rays, BVHOptions::packetFallbackRays)
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "BVH.h"
+#include "RayPacket.h"
+#include "Triangle.h"
+
+using Clock = std::chrono::steady_clock;
+
+static const char* layoutNames[] = {"pointer", "linear ", "wide4  "};
+
+static double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    std::string filename = argc > 1 ? argv[1] : "models/cyborg.obj";
+    size_t rayCount = argc > 2 ? atoi(argv[2]) : 1000000;
+    int packetFallbackRays = argc > 3 ? atoi(argv[3]) : BVHOptions().packetFallbackRays;
+
+    objl::Loader loader;
+    if (!loader.LoadFile(filename) || loader.LoadedMeshes.empty()) {
+        std::cerr << "Failed to load " << filename << std::endl;
+        return 1;
+    }
+    Material material;
+    std::vector<Object*> triangles;
+    Bounds3 meshBounds;
+    // objl keeps every corner of a face as a vertex and lists its triangles by index.
+    for (const Mesh& mesh : loader.LoadedMeshes) {
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+            triangles.push_back(new Triangle(mesh.vertices[mesh.indices[i]], mesh.vertices[mesh.indices[i + 1]],
+                                             mesh.vertices[mesh.indices[i + 2]], &material));
+            meshBounds = merge(meshBounds, triangles.back()->getBounds());
+        }
+    }
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> unit(0, 1);
+    Vec3 extent = meshBounds.pMax - meshBounds.pMin;
+    float radius = extent.abs();
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < rayCount; i++) {
+        Vec3 target = meshBounds.pMin + Vec3(unit(rng), unit(rng), unit(rng)) * extent;
+        Vec3 origin = meshBounds.centroid +
+                      normalize(Vec3(unit(rng), unit(rng), unit(rng)) - Vec3(0.5f)) * radius;
+        rays.emplace_back(origin, normalize(target - origin));
+    }
+
+    // A square image of about rayCount pixels, seen from a corner of the bounds.
+    int side = std::max(4, int(sqrtf(float(rayCount))) / 4 * 4);
+    std::vector<Ray> cameraRays;
+    Vec3 eye = meshBounds.centroid + normalize(Vec3(1, 0.5f, 1)) * radius;
+    Vec3 front = normalize(meshBounds.centroid - eye);
+    Vec3 right = normalize(cross(front, Vec3(0, 1, 0)));
+    Vec3 up = cross(right, front);
+    for (int by = 0; by < side; by += 2) {
+        for (int bx = 0; bx < side; bx += 4) {
+            for (int lane = 0; lane < RayPacket::size; lane++) {
+                float x = (bx + lane % 4 + 0.5f) / side - 0.5f, y = (by + lane / 4 + 0.5f) / side - 0.5f;
+                cameraRays.emplace_back(eye, normalize(front + x * right + y * up));
+            }
+        }
+    }
+
+    std::cout << filename << ": " << triangles.size() << " triangles, " << rayCount << " random rays, "
+              << cameraRays.size() << " camera rays, packets fall back at " << packetFallbackRays << " rays"
+              << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    std::vector<float> reference;
+    for (int run = 0; run < 6; run++) {
+        BVHLayout layout = BVHLayout(run % 3);
+        bool packed = run >= 3;
+        BVHOptions options;
+        options.layout = layout;
+        options.packetFallbackRays = packetFallbackRays;
+        BVH bvh(triangles, options);
+        if (packed) {
+            bvh.packTriangles([](const Object* object, Vec3& v0, Vec3& e1, Vec3& e2) {
+                const Triangle* triangle = static_cast<const Triangle*>(object);
+                v0 = triangle->v0;
+                e1 = triangle->e1;
+                e2 = triangle->e2;
+            });
+        }
+
+        threadTraversalStats = TraversalStats();
+        std::vector<float> distances(rayCount);
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < rayCount; i++)
+            distances[i] = bvh.rayCast(rays[i]).distance;
+        double closestSeconds = secondsSince(start);
+        uint64_t nodeVisits = threadTraversalStats.nodeVisits;
+
+        size_t blocked = 0;
+        start = Clock::now();
+        for (size_t i = 0; i < rayCount; i++)
+            blocked += bvh.occluded(rays[i], radius);
+        double anySeconds = secondsSince(start);
+
+        auto traceSingle = [&](const std::vector<Ray>& rays, std::vector<float>& t) {
+            t.assign(rays.size(), 0);
+            Clock::time_point start = Clock::now();
+            for (size_t i = 0; i < rays.size(); i++) {
+                Hit hit;
+                bvh.intersect(rays[i], hit);
+                t[i] = hit.t;
+            }
+            return rays.size() / secondsSince(start) * 1e-6;
+        };
+        auto tracePackets = [&](const std::vector<Ray>& rays, std::vector<float>& t) {
+            t.assign(rays.size(), 0);
+            Clock::time_point start = Clock::now();
+            for (size_t first = 0; first < rays.size(); first += RayPacket::size) {
+                RayPacket packet;
+                int active = 0;
+                for (int lane = 0; lane < RayPacket::size && first + lane < rays.size(); lane++) {
+                    packet.set(lane, rays[first + lane]);
+                    active |= 1 << lane;
+                }
+                Hit hits[RayPacket::size];
+                bvh.intersect(packet, active, hits);
+                for (int lane = 0; lane < RayPacket::size && first + lane < rays.size(); lane++)
+                    t[first + lane] = hits[lane].t;
+            }
+            return rays.size() / secondsSince(start) * 1e-6;
+        };
+        std::vector<float> single, packets, cameraSingle, cameraPackets;
+        double randomSingleRate = traceSingle(rays, single);
+        double randomPacketRate = tracePackets(rays, packets);
+        double cameraSingleRate = traceSingle(cameraRays, cameraSingle);
+        double cameraPacketRate = tracePackets(cameraRays, cameraPackets);
+        bool samePackets = single == packets && cameraSingle == cameraPackets;
+
+        if (reference.empty())
+            reference = distances;
+        std::cout << layoutNames[int(layout)] << (packed ? " packed" : "       ") << ": " << std::setw(6) << bvh.nodeCount() << " nodes, closest hit "
+                  << std::setw(6) << rayCount / closestSeconds * 1e-6 << " Mrays/s (" << double(nodeVisits) / rayCount
+                  << " node visits per ray), any hit " << std::setw(6) << rayCount / anySeconds * 1e-6
+                  << " Mrays/s, " << blocked << " blocked, "
+                  << (distances == reference ? "same hits" : "DIFFERENT HITS") << std::endl;
+        std::cout << "    closest hit, single rays / packets of " << RayPacket::size << ": random " << std::setw(6)
+                  << randomSingleRate << " / " << std::setw(6) << randomPacketRate << " Mrays/s, camera "
+                  << std::setw(6) << cameraSingleRate << " / " << std::setw(6) << cameraPacketRate << " Mrays/s, "
+                  << (samePackets ? "same hits" : "DIFFERENT HITS") << std::endl;
+    }
+
+    for (Object* triangle : triangles)
+        delete triangle;
+    return 0;
+}
@@ -0,0 +1,86 @@
+// Times the two innermost traversal kernels, the ray-box slab test and the
+// Möller Trumbore ray-triangle test, over random rays and primitives. Build
+// it as KernelBench (configured RT_SIMD backend) and KernelBenchScalar to
+// compare backends.
+//
+// Usage: KernelBench [count] [repeats]   (default 4096 primitives, 2000 repeats)
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "Bounds3.h"
+#include "Triangle.h"
+
+using Clock = std::chrono::steady_clock;
+
+#if defined(RT_SIMD_AVX)
+static const char* backendName = "AVX";
+#elif defined(RT_SIMD_SSE)
+static const char* backendName = "SSE";
+#else
+static const char* backendName = "scalar";
+#endif
+
+static double nanosecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+static void report(const char* kernel, double ns, size_t tests, size_t hits) {
+    std::cout << std::setw(8) << backendName << " " << kernel << ": " << std::setw(6) << ns / tests
+              << " ns/test, " << std::setw(7) << tests / ns * 1e3 << " Mtests/s, "
+              << 100.0 * hits / tests << "% hit" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    size_t count = argc > 1 ? atoi(argv[1]) : 4096;
+    int repeats = argc > 2 ? atoi(argv[2]) : 2000;
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> unit(-1, 1);
+    auto randomPoint = [&](float scale) { return Vec3(unit(rng), unit(rng), unit(rng)) * scale; };
+
+    // Rays start on a shell around the unit cube and aim near the primitive
+    // they are tested against, so a good share of the tests hit.
+    std::vector<Ray> rays;
+    std::vector<Bounds3> boxes;
+    std::vector<Vec3> v0s, e1s, e2s;
+    for (size_t i = 0; i < count; i++) {
+        Vec3 origin = normalize(randomPoint(1)) * 3;
+        Vec3 center = randomPoint(0.5f);
+        rays.emplace_back(origin, normalize(center + randomPoint(0.3f) - origin));
+        Vec3 half = Vec3(0.1f) + randomPoint(0.2f) * randomPoint(1);
+        boxes.emplace_back(center - half, center + half);
+        Vec3 v0 = center + randomPoint(0.2f), v1 = v0 + randomPoint(0.8f), v2 = v0 + randomPoint(0.8f);
+        v0s.push_back(v0);
+        e1s.push_back(v1 - v0);
+        e2s.push_back(v2 - v0);
+    }
+
+    std::cout << std::fixed << std::setprecision(2);
+    size_t tests = count * repeats;
+
+    size_t hits = 0;
+    Clock::time_point start = Clock::now();
+    for (int r = 0; r < repeats; r++) {
+        for (size_t i = 0; i < count; i++) {
+            float tEnter;
+            hits += boxes[i].rayCast(rays[i], std::numeric_limits<float>::max(), tEnter);
+        }
+    }
+    report("ray-box     ", nanosecondsSince(start), tests, hits);
+
+    hits = 0;
+    start = Clock::now();
+    for (int r = 0; r < repeats; r++) {
+        for (size_t i = 0; i < count; i++) {
+            float t, u, v;
+            hits += rayTriangleIntersect(v0s[i], e1s[i], e2s[i], rays[i].origin, rays[i].direction, t, u, v);
+        }
+    }
+    report("ray-triangle", nanosecondsSince(start), tests, hits);
+    return 0;
+}
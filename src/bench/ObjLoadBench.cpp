@@ -0,0 +1,145 @@
+// Times loading an OBJ file with objl::Loader, loadObj at several thread
+// counts and loadObjStreaming, checks that all give the same indexed mesh
+// and reports the peak resident memory of each. objl triangulates polygons
+// other than triangles its own way; for such files the other loaders are
+// only checked against each other.
+//
+// Usage: ObjLoadBench [model.obj] [threads...] [--memory-limit=MB]
+//        (default models/cyborg.obj, 1 and all cores, no limit)
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "IndexedMesh.h"
+#include "Material.h"
+#include "OBJ_Loader.h"
+#include "ObjParser.h"
+#include "global.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double millisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static bool sameMesh(const IndexedMesh& a, const IndexedMesh& b) {
+    if (a.indices != b.indices || a.positions.size() != b.positions.size())
+        return false;
+    for (size_t i = 0; i < a.positions.size(); i++) {
+        if (a.positions[i] != b.positions[i] || a.stCoordinates[i].x != b.stCoordinates[i].x ||
+            a.stCoordinates[i].y != b.stCoordinates[i].y)
+            return false;
+    }
+    return true;
+}
+
+// Peak resident memory while load ran, above the resident size before it.
+struct Measurement {
+    double ms;
+    size_t peakBytes;
+};
+
+template <typename Load>
+static Measurement measure(Load load) {
+#ifdef __GLIBC__
+    // Hand memory freed by earlier runs back, so it is not reused for free.
+    malloc_trim(0);
+#endif
+    size_t residentBefore, peakBefore, resident, peak;
+    resetPeakMemory();
+    memoryUsage(residentBefore, peakBefore);
+    Clock::time_point start = Clock::now();
+    load();
+    double ms = millisecondsSince(start);
+    memoryUsage(resident, peak);
+    return {ms, peak - residentBefore};
+}
+
+static void report(const std::string& name, const Measurement& m, double objlMs, const char* check) {
+    std::cout << std::left << std::setw(22) << name << std::right << std::setw(8) << m.ms << " ms ("
+              << std::setw(5) << objlMs / m.ms << "x), peak RSS +" << std::setw(7) << m.peakBytes / 1024 << " KB"
+              << check << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::string filename = "models/cyborg.obj";
+    size_t memoryLimit = 0;
+    std::vector<int> threadCounts;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--memory-limit=", 15) == 0)
+            memoryLimit = size_t(atof(argv[i] + 15) * 1024 * 1024);
+        else if (i == 1)
+            filename = argv[i];
+        else
+            threadCounts.push_back(atoi(argv[i]));
+    }
+    if (threadCounts.empty())
+        threadCounts = {1, 0};
+
+    std::cout << std::fixed << std::setprecision(1);
+    IndexedMesh reference;
+    // Whether every face is a triangle, i.e. objl lists each corner once.
+    bool trianglesOnly = true;
+    Measurement objl = measure([&]() {
+        objl::Loader loader;
+        if (!loader.LoadFile(filename))
+            return;
+        IndexedMeshBuilder builder(reference);
+        for (const Mesh& mesh : loader.LoadedMeshes) {
+            trianglesOnly &= mesh.indices.size() == mesh.vertices.size();
+            for (unsigned int index : mesh.indices)
+                builder.addCorner(mesh.vertices[index].position, mesh.vertices[index].texCoord);
+        }
+    });
+    if (reference.indices.empty()) {
+        std::cerr << "Cannot load " << filename << std::endl;
+        return 1;
+    }
+    size_t meshBytes = reference.positions.size() * (sizeof(Vec3) + sizeof(Vec2)) +
+                       reference.indices.size() * sizeof(uint32_t);
+    std::cout << filename << ": " << reference.indices.size() / 3 << " triangles, " << reference.positions.size()
+              << " vertices, " << meshBytes / 1024 << " KB indexed" << std::endl;
+    report("objl", objl, objl.ms, "");
+
+    // Without objl's mesh to go by, the first fast load is the reference.
+    IndexedMesh fastReference;
+    const IndexedMesh* expected = trianglesOnly ? &reference : NULL;
+    if (!trianglesOnly)
+        std::cout << "objl splits polygons differently; checking the other loaders against each other" << std::endl;
+    bool allSame = true;
+    auto check = [&](bool loaded, const IndexedMesh& mesh) {
+        if (loaded && expected == NULL) {
+            fastReference = mesh;
+            expected = &fastReference;
+            return ", reference";
+        }
+        bool same = loaded && expected != NULL && sameMesh(mesh, *expected);
+        allSame &= same;
+        return same ? ", same mesh" : ", MESH DIFFERS";
+    };
+    for (int threads : threadCounts) {
+        IndexedMesh mesh;
+        bool loaded = false;
+        Measurement m = measure([&]() { loaded = loadObj(filename, mesh, threads); });
+        report("fast, " + std::to_string(threads) + " threads", m, objl.ms, check(loaded, mesh));
+    }
+
+    IndexedMesh mesh;
+    bool loaded = false;
+    size_t estimate = 0;
+    Measurement m = measure([&]() { loaded = loadObjStreaming(filename, mesh, memoryLimit, estimate); });
+    std::string name = "streaming";
+    if (memoryLimit > 0)
+        name += ", " + std::to_string(memoryLimit / 1024) + " KB cap";
+    report(name, m, objl.ms, check(loaded, mesh));
+    std::cout << "streaming loader estimate: peak " << estimate / 1024 << " KB" << std::endl;
+    return allSame ? 0 : 1;
+}
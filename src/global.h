@@ -1,8 +1,9 @@
 #pragma once
 
 #include <cmath>
+#include <fstream>
 #include <iostream>
-#include <random>
+#include <string>
 
 
 const float EPSILON = 0.0001;
@@ -31,12 +32,6 @@ inline bool solveQuadratic(const float &a, const float &b, const float &c, float
     return true;
 }
 
-inline float rand_n1_1() {
-    static std::default_random_engine e;
-    static std::uniform_real_distribution<> dis(-1, 1);
-    return dis(e);
-}
-
 inline void updateProgress(float progress) {
     int barWidth = 50;
     std::cout << "[";
@@ -47,3 +42,26 @@ inline void updateProgress(float progress) {
     std::cout << "] " << int(progress * 100.0) << " %\r";
     std::cout.flush();
 };
+
+// Resident set size of this process and its high-water mark, in bytes, from
+// /proc/self/status. Both stay 0 where that file does not exist.
+inline void memoryUsage(size_t &resident, size_t &peak) {
+    resident = peak = 0;
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0)
+            resident = std::stoull(line.substr(6)) * 1024;
+        else if (line.compare(0, 6, "VmHWM:") == 0)
+            peak = std::stoull(line.substr(6)) * 1024;
+    }
+}
+
+// Lowers the high-water mark reported by memoryUsage to the current resident
+// size, so a later call shows the peak of what ran in between. Linux only;
+// a no-op elsewhere.
+inline void resetPeakMemory() {
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    if (clearRefs)
+        clearRefs << "5";
+}
@@ -1,3 +1,13 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <string>
+
+#include "Animation.h"
+#include "Instance.h"
 #include "Renderer.h"
 #include "Scene.h"
 #include "Triangle.h"
@@ -5,23 +15,128 @@
 #include "Vector.h"
 #include "global.h"
 
+// Empty for a name that is not a split method.
+static std::optional<BVHSplitMethod> parseSplitMethod(const char* name) {
+    if (strcmp(name, "median") == 0)
+        return BVHSplitMethod::MEDIAN;
+    if (strcmp(name, "sah") == 0)
+        return BVHSplitMethod::SAH;
+    if (strcmp(name, "lbvh") == 0)
+        return BVHSplitMethod::LBVH;
+    std::cerr << "Unknown BVH split method " << name << " (median, sah or lbvh)" << std::endl;
+    return std::nullopt;
+}
+
 int main(int argc, char** argv) {
     bool bvhEnable = true;
     int sceneIdx = 0;
     int sampleCount = 1;
-    if (argc > 1 && atoi(argv[1]) == 0)
+    int threadCount = 0;
+    uint64_t seed = 0;
+    bool directLighting = true;
+    int frameCount = 0;
+    bool refitFrames = true;
+    bool rayPackets = true;
+    Integrator integrator = Integrator::PATH;
+    BVHOptions bvhOptions;
+    MeshLoadOptions meshOptions;
+    std::optional<BVHSplitMethod> sceneSplitMethod;
+    // Positional arguments: [bvh] [scene] [samples], options: --name=value
+    std::vector<const char*> positional;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--threads=", 10) == 0)
+            threadCount = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--seed=", 7) == 0)
+            seed = strtoull(argv[i] + 7, NULL, 10);
+        else if (strncmp(argv[i], "--nee=", 6) == 0)
+            directLighting = atoi(argv[i] + 6) != 0;
+        else if (strncmp(argv[i], "--ray-packets=", 14) == 0)
+            rayPackets = atoi(argv[i] + 14) != 0;
+        else if (strncmp(argv[i], "--frames=", 9) == 0)
+            frameCount = atoi(argv[i] + 9);
+        else if (strcmp(argv[i], "--frame-update=refit") == 0)
+            refitFrames = true;
+        else if (strcmp(argv[i], "--frame-update=rebuild") == 0)
+            refitFrames = false;
+        else if (strcmp(argv[i], "--integrator=whitted") == 0)
+            integrator = Integrator::WHITTED;
+        else if (strcmp(argv[i], "--integrator=path") == 0)
+            integrator = Integrator::PATH;
+        else if (strcmp(argv[i], "--bvh-layout=pointer") == 0)
+            bvhOptions.layout = BVHLayout::POINTER;
+        else if (strcmp(argv[i], "--bvh-layout=linear") == 0)
+            bvhOptions.layout = BVHLayout::LINEAR;
+        else if (strcmp(argv[i], "--bvh-layout=wide4") == 0)
+            bvhOptions.layout = BVHLayout::WIDE4;
+        else if (strncmp(argv[i], "--bvh-split=", 12) == 0) {
+            std::optional<BVHSplitMethod> splitMethod = parseSplitMethod(argv[i] + 12);
+            if (!splitMethod)
+                return 1;
+            bvhOptions.splitMethod = *splitMethod;
+        } else if (strncmp(argv[i], "--scene-bvh-split=", 18) == 0) {
+            sceneSplitMethod = parseSplitMethod(argv[i] + 18);
+            if (!sceneSplitMethod)
+                return 1;
+        }
+        else if (strncmp(argv[i], "--bvh-buckets=", 14) == 0)
+            bvhOptions.bucketCount = atoi(argv[i] + 14);
+        else if (strncmp(argv[i], "--bvh-leaf-size=", 16) == 0)
+            bvhOptions.maxLeafSize = atoi(argv[i] + 16);
+        else if (strncmp(argv[i], "--bvh-traversal-cost=", 21) == 0)
+            bvhOptions.traversalCost = atof(argv[i] + 21);
+        else if (strcmp(argv[i], "--bvh-no-pack") == 0)
+            bvhOptions.packTriangles = false;
+        else if (strncmp(argv[i], "--bvh-packet-fallback=", 22) == 0)
+            bvhOptions.packetFallbackRays = atoi(argv[i] + 22);
+        else if (strcmp(argv[i], "--bvh-no-cull") == 0)
+            bvhOptions.closestHitCulling = false;
+        else if (strncmp(argv[i], "--bvh-build-threads=", 20) == 0)
+            bvhOptions.buildThreads = atoi(argv[i] + 20);
+        else if (strcmp(argv[i], "--obj-loader=objl") == 0)
+            meshOptions.objLoader = ObjLoader::OBJL;
+        else if (strcmp(argv[i], "--obj-loader=fast") == 0)
+            meshOptions.objLoader = ObjLoader::PARALLEL;
+        else if (strcmp(argv[i], "--obj-loader=stream") == 0)
+            meshOptions.objLoader = ObjLoader::STREAMING;
+        else if (strncmp(argv[i], "--obj-memory-limit=", 19) == 0)
+            meshOptions.objMemoryLimit = size_t(atof(argv[i] + 19) * 1024 * 1024);
+        else if (strncmp(argv[i], "--geometry-cache=", 17) == 0)
+            meshOptions.cacheDirectory = argv[i] + 17;
+        else
+            positional.push_back(argv[i]);
+    }
+    if (positional.size() > 0 && atoi(positional[0]) == 0)
         bvhEnable = false;
-    if (argc > 2)
-        sceneIdx = atoi(argv[2]);
-    if (argc > 3)
-        sampleCount = atoi(argv[3]);
+    if (positional.size() > 1)
+        sceneIdx = atoi(positional[1]);
+    if (positional.size() > 2)
+        sampleCount = atoi(positional[2]);
     
     Scene scene;
+    Animation animation;
+    // The default camera path orbits the point this far in front of the camera.
+    float orbitDistance = 1;
+    std::chrono::steady_clock::time_point setupStart = std::chrono::steady_clock::now();
     scene.bvhEnable = bvhEnable;
+    scene.directLighting = directLighting;
+    scene.integrator = integrator;
+    scene.bvhOptions = bvhOptions;
+    if (sceneSplitMethod)
+        scene.bvhOptions.splitMethod = *sceneSplitMethod;
+    // A mesh that fails to load ends the run once the scene is set up.
+    bool meshesLoaded = true;
+    auto loadMesh = [&](const char* filename, Material* material) {
+        // So the mesh's report shows the peak memory of its own load.
+        resetPeakMemory();
+        MeshTriangle* mesh = new MeshTriangle(filename, material, bvhEnable, bvhOptions, meshOptions);
+        meshesLoaded &= mesh->loaded();
+        return mesh;
+    };
     if (sceneIdx == 0) {
         scene.width = 1200;
         scene.height = 1200;
         scene.camera = Camera(Vec3(0, 2, 9), Vec3(0, 0, -1), Vec3(0, 1, 0), 90, scene.width / scene.height);
+        orbitDistance = 9;
         scene.Add(new Sphere(Vec3(-2, 2.5, 2.8), 2.5, METAL, Vec3(0.5)));
         scene.Add(new Sphere(Vec3(5, 3, 1), 3, TRANSPARENT, Vec3(1)));
         scene.Add(new Sphere(Vec3(-2.3, 0.5, 3), 0.5, LAMBERTIAN, Vec3(0.2, 0.3, 0.3)));
@@ -30,7 +145,7 @@ int main(int argc, char** argv) {
         scene.Add(new Sphere(Vec3(-3, 0.3, 5), 0.3, LAMBERTIAN, Vec3(0.8, 0.0, 0.3)));
         scene.Add(new Sphere(Vec3(3, 0.5, 4), 0.5, LAMBERTIAN, Vec3(0.5, 0.9, 0.9)));
         scene.Add(new Sphere(Vec3(-4.5, 0.5, 4), 0.5, LAMBERTIAN, Vec3(0, 0.9, 0.3)));
-        scene.Add(new MeshTriangle("models/plane.obj", new Material(LAMBERTIAN, Vec3(1)), bvhEnable));
+        scene.Add(loadMesh("models/plane.obj", new Material(LAMBERTIAN, Vec3(1))));
         Sphere* l1 = new Sphere(Vec3(-5, 25, 30), 5, LIGHT, Vec3(1));
         l1->material->kd = 1.0f;
         scene.Add(l1);
@@ -41,6 +156,7 @@ int main(int argc, char** argv) {
         scene.width = 800;
         scene.height = 800;
         scene.camera = Camera(Vec3(-0.2, 2.66, 2.3), Vec3(0, 0, -1), Vec3(0, 1, 0), 90, scene.width / scene.height);
+        orbitDistance = 2.3;
 
         Material* red = new Material(LAMBERTIAN, Vec3(0.63f, 0.065f, 0.05f));
         red->kd = 1.5 * Vec3(0.63f, 0.065f, 0.05f);
@@ -53,14 +169,14 @@ int main(int argc, char** argv) {
         Material* box = new Material(LAMBERTIAN, Vec3(1));
         box->kd = Vec3(0.6f);
 
-        MeshTriangle* back = new MeshTriangle("models/back.obj", white, bvhEnable);
-        MeshTriangle* ceiling = new MeshTriangle("models/ceiling.obj", white, bvhEnable);
-        MeshTriangle* floor = new MeshTriangle("models/floor.obj", white, bvhEnable);
-        MeshTriangle* shortbox = new MeshTriangle("models/shortbox.obj", box, bvhEnable);
-        MeshTriangle* tallbox = new MeshTriangle("models/tallbox.obj", box, bvhEnable);
-        MeshTriangle* left = new MeshTriangle("models/left.obj", red, bvhEnable);
-        MeshTriangle* right = new MeshTriangle("models/right.obj", green, bvhEnable);
-        MeshTriangle* light = new MeshTriangle("models/light.obj", whiteLight, bvhEnable);
+        MeshTriangle* back = loadMesh("models/back.obj", white);
+        MeshTriangle* ceiling = loadMesh("models/ceiling.obj", white);
+        MeshTriangle* floor = loadMesh("models/floor.obj", white);
+        MeshTriangle* shortbox = loadMesh("models/shortbox.obj", box);
+        MeshTriangle* tallbox = loadMesh("models/tallbox.obj", box);
+        MeshTriangle* left = loadMesh("models/left.obj", red);
+        MeshTriangle* right = loadMesh("models/right.obj", green);
+        MeshTriangle* light = loadMesh("models/light.obj", whiteLight);
         scene.Add(back);
         scene.Add(ceiling);
         scene.Add(floor);
@@ -74,7 +190,60 @@ int main(int argc, char** argv) {
         scene.width = 600;
         scene.height = 600;
         scene.camera = Camera(Vec3(0, 2, 2), Vec3(0, 0, -1), Vec3(0, 1, 0), 90, scene.width / scene.height);
-        scene.Add(new MeshTriangle("models/rock.obj", new Material(LAMBERTIAN, Vec3(1)), bvhEnable));
+        orbitDistance = 2;
+        scene.Add(loadMesh("models/rock.obj", new Material(LAMBERTIAN, Vec3(1))));
+        Sphere* l1 = new Sphere(Vec3(-5, 25, 30), 5, LIGHT, Vec3(1));
+        l1->material->kd = 1.0f;
+        scene.Add(l1);
+        Sphere* l2 = new Sphere(Vec3(5, 30, 40), 3, LIGHT, Vec3(1));
+        l2->material->kd = 0.8f;
+        scene.Add(l2);
+    } else if (sceneIdx == 3) {
+        scene.width = 600;
+        scene.height = 600;
+        scene.camera = Camera(Vec3(0, 2, 2.5), Vec3(0, 0, -1), Vec3(0, 1, 0), 90, scene.width / scene.height);
+        orbitDistance = 2.5;
+        scene.Add(loadMesh("models/cyborg.obj", new Material(LAMBERTIAN, Vec3(1))));
+        Sphere* l1 = new Sphere(Vec3(-5, 25, 30), 5, LIGHT, Vec3(1));
+        l1->material->kd = 1.0f;
+        scene.Add(l1);
+        Sphere* l2 = new Sphere(Vec3(5, 30, 40), 3, LIGHT, Vec3(1));
+        l2->material->kd = 0.8f;
+        scene.Add(l2);
+    } else if (sceneIdx == 4) {
+        // A field of rocks that all share one mesh and one BVH.
+        scene.width = 800;
+        scene.height = 800;
+        scene.camera = Camera(Vec3(0, 5, 14), Vec3(0, -0.4, -1), Vec3(0, 1, 0), 70, scene.width / scene.height);
+        orbitDistance = 14;
+        scene.Add(loadMesh("models/plane.obj", new Material(LAMBERTIAN, Vec3(1))));
+        std::shared_ptr<MeshTriangle> rock(loadMesh("models/rock.obj", new Material(LAMBERTIAN, Vec3(0.6, 0.5, 0.4))));
+        const int side = 100;
+        const float spacing = 0.5f;
+        Sampler random(0, 0, 1);
+        for (int i = 0; i < side * side; i++) {
+            float x = (i % side - side / 2 + random.get1D()) * spacing;
+            float z = (i / side - side / 2 + random.get1D()) * spacing;
+            float s = 0.06f + 0.1f * random.get1D();
+            // rock.obj reaches 0.31 below its origin; lift it onto the plane.
+            Transform t = Transform::translate(Vec3(x, 0.31f * s, z)) *
+                          Transform::rotate(360 * random.get1D(), Vec3(0, 1, 0)) * Transform::scale(Vec3(s));
+            Instance* instance = scene.Emplace<Instance>(rock, t);
+            // Every tenth rock hops and spins over the course of an animation.
+            if (i % 10 == 0) {
+                InstanceAnimation hop;
+                hop.instance = instance;
+                hop.rest = t;
+                hop.translation.add(0, Vec3(0));
+                hop.translation.add(0.5f, Vec3(0, 0.5f + random.get1D(), 0));
+                hop.translation.add(1, Vec3(0));
+                hop.angle.add(0, 0);
+                hop.angle.add(1, 360);
+                animation.instances.push_back(hop);
+            }
+        }
+        std::cout << side * side << " instances of models/rock.obj, " << side * side * sizeof(Instance) / 1024
+                  << " KB" << std::endl;
         Sphere* l1 = new Sphere(Vec3(-5, 25, 30), 5, LIGHT, Vec3(1));
         l1->material->kd = 1.0f;
         scene.Add(l1);
@@ -82,10 +251,48 @@ int main(int argc, char** argv) {
         l2->material->kd = 0.8f;
         scene.Add(l2);
     }
+    if (!meshesLoaded)
+        return 1;
     scene.buildBVH();
     Renderer r;
+    r.seed = seed;
+    r.rayPackets = rayPackets;
+    if (frameCount > 0) {
+        auto millisecondsSince = [](std::chrono::steady_clock::time_point start) {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        };
+        std::cout << "Scene setup (meshes and BVHs): " << millisecondsSince(setupStart) << " ms" << std::endl;
+        // Swing the camera 40 degrees around the point it looks at.
+        Camera baseCamera = scene.camera;
+        Vec3 center = baseCamera.getPosition() + baseCamera.getFront() * orbitDistance;
+        for (int k = 0; k <= 8; k++) {
+            Transform orbit = Transform::rotate(-20 + 40 * k / 8.f, Vec3(0, 1, 0));
+            animation.cameraPosition.add(k / 8.f, center + orbit.vector(baseCamera.getPosition() - center));
+        }
+        animation.cameraTarget.add(0, center);
+        for (int frame = 0; frame < frameCount; frame++) {
+            float time = frameCount > 1 ? frame / float(frameCount - 1) : 0;
+            std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+            scene.camera = baseCamera.lookAt(animation.cameraPosition.at(time), animation.cameraTarget.at(time));
+            for (const InstanceAnimation& instance : animation.instances)
+                instance.instance->setTransform(instance.at(time));
+            // Only the top level depends on where instances are; meshes keep their BVHs.
+            if (!animation.instances.empty())
+                scene.updateBVH(refitFrames);
+            double buildMs = millisecondsSince(buildStart);
+            char filename[32];
+            snprintf(filename, sizeof(filename), "output_%04d.png", frame);
+            std::chrono::steady_clock::time_point renderStart = std::chrono::steady_clock::now();
+            r.Render(scene, sampleCount, threadCount, filename);
+            double renderMs = millisecondsSince(renderStart);
+            std::cout << "Frame " << frame << " -> " << filename << ": BVH "
+                      << (animation.instances.empty() ? "unchanged" : refitFrames ? "refit" : "rebuild") << " "
+                      << buildMs << " ms, render " << renderMs << " ms" << std::endl;
+        }
+        return 0;
+    }
     time_t startTime = time(NULL);
-    r.Render(scene, sampleCount);
+    r.Render(scene, sampleCount, threadCount);
     time_t stopTime = time(NULL);
     long seconds = stopTime - startTime;
     long minutes = seconds / 60;